@@ -1,209 +1,3126 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_VALUE_LENGTH 4096
+#define MAX_KEY_LENGTH 256
+#define INDEX_MIN_SLOTS 16
+#define INDEX_MAX_LOAD_PERCENT 75
+#define CACHE_LINE_SIZE 64
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+#define SKETCH_SAMPLE_FACTOR 10
+#define WINDOW_PERCENT 1
+#define PROTECTED_PERCENT 80
+#define NODE_SLAB_BITS 10
+#define NODE_SLAB_SIZE (1 << NODE_SLAB_BITS)
+#define NODE_NONE 0U
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define VALUE_CLASS_COUNT 47
+#define LARGE_VALUE_CLASS 255
+#define EXPECTED_VALUE_BYTES 64
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define BATCH_CHUNK_SIZE 64
+#define EPOCH_MAX_READERS 256
+#define READER_SLOT_WORDS (EPOCH_MAX_READERS / 64)
+#define READ_BUFFER_STRIPES 8
+#define READ_BUFFER_SIZE 64
+#define RETIRE_BATCH_SIZE 64
+#define SNAPSHOT_MAGIC 0x5355524cU
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_WRITE_BUFFER (1 << 20)
+#define COMMAND_OUTPUT_BUFFER (1 << 20)
+#define COMMAND_MISS 0xFFFFFFFFU
+#define BENCH_MAX_RUNS 16
+#define BENCH_VALUE_LENGTH 32
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS (32 * LATENCY_SUB_BUCKETS)
+#define LN2 0.69314718055994530942
+
+typedef enum
+{
+    EVICTION_LRU,
+    EVICTION_CLOCK,
+    EVICTION_WTINYLFU
+} EvictionPolicy;
+
+typedef enum
+{
+    KEY_INT64,
+    KEY_STRING
+} KeyType;
+
+typedef struct CacheKey
+{
+    KeyType type;
+    long long intValue;
+    const char *bytes;
+    size_t length;
+} CacheKey;
+
+typedef enum
+{
+    SEGMENT_RECENCY,
+    SEGMENT_PROBATION,
+    SEGMENT_PROTECTED,
+    SEGMENT_COUNT
+} Segment;
+
+/* A non-zero maxBytes bounds the cache by total entry footprint and capacity is ignored. */
+typedef struct CacheConfig
+{
+    int capacity;
+    size_t maxBytes;
+    int shardCount;
+    EvictionPolicy policy;
+    bool recordLatency;
+    bool lockFreeReads;
+} CacheConfig;
+
+typedef struct BatchGet
+{
+    CacheKey key;
+    void *buffer;
+    size_t bufferSize;
+    size_t valueLength;
+    bool found;
+} BatchGet;
+
+typedef struct BatchPut
+{
+    CacheKey key;
+    const void *value;
+    size_t length;
+    long long ttlMillis;
+    bool stored;
+} BatchPut;
+
+/*
+ * Batches are resolved in chunks: every key is hashed first, the chunk is
+ * grouped by shard (keeping request order within a shard), and each shard is
+ * locked once while its home index slots and then the nodes they point at are
+ * prefetched before any key is resolved.
+ */
+typedef struct BatchPlan
+{
+    unsigned long long hashes[BATCH_CHUNK_SIZE];
+    int order[BATCH_CHUNK_SIZE];
+    int groupShards[BATCH_CHUNK_SIZE];
+    int groupStarts[BATCH_CHUNK_SIZE + 1];
+    int groupCount;
+} BatchPlan;
+
+/* Snapshot files are in native byte order: a header, then one record per entry followed by its key and value bytes. */
+typedef struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entryCount;
+} SnapshotHeader;
+
+typedef struct SnapshotRecord
+{
+    uint32_t keyLength;
+    uint32_t valueLength;
+    uint8_t keyType;
+    uint8_t segment;
+    uint16_t reserved;
+    uint32_t reserved2;
+    int64_t intKey;
+    int64_t expiresAtWallMillis;
+} SnapshotRecord;
+
+typedef enum
+{
+    COMMAND_CREATE = 1,
+    COMMAND_PUT = 2,
+    COMMAND_PUT_TTL = 3,
+    COMMAND_GET = 4
+} CommandCode;
+
+/*
+ * Every binary command starts with this header, followed by an int64 TTL for COMMAND_PUT_TTL,
+ * then keyLength key bytes (exactly 8 for KEY_INT64), then argument value bytes for puts.
+ * For COMMAND_CREATE the argument is the capacity and there is no key.
+ */
+typedef struct CommandHeader
+{
+    uint8_t opcode;
+    uint8_t keyType;
+    uint16_t keyLength;
+    uint32_t argument;
+} CommandHeader;
+
+typedef struct OutputBuffer
+{
+    char *data;
+    size_t used;
+} OutputBuffer;
+
+/* String keys are stored in front of the value bytes, which are NUL-terminated. */
+typedef struct ValueBlock
+{
+    unsigned int length;
+    unsigned int keyLength;
+    unsigned char sizeClass;
+    char data[];
+} ValueBlock;
+
+/*
+ * Exactly one cache line per entry. The fields a lookup reads come first, and list and timer
+ * links are 32-bit node ids resolved through the shard's NodeTable rather than pointers.
+ */
+typedef struct QueueNode
+{
+    _Alignas(CACHE_LINE_SIZE) unsigned int hash;
+    unsigned int id;
+    long long intKey;
+    long long expiresAt;
+    ValueBlock *value;
+    size_t charge;
+    unsigned int prev;
+    unsigned int next;
+    unsigned int timerPrev;
+    unsigned int timerNext;
+    unsigned char keyType;
+    bool referenced;
+    bool resident;
+    unsigned char segment;
+    unsigned char timerLevel;
+    unsigned char timerSlot;
+} QueueNode;
+
+_Static_assert(sizeof(QueueNode) == CACHE_LINE_SIZE, "QueueNode must fill exactly one cache line");
+
+typedef struct NodeSlab
+{
+    struct NodeSlab *next;
+    QueueNode nodes[];
+} NodeSlab;
+
+/* Node id N lives at slabs[N >> NODE_SLAB_BITS][N & (NODE_SLAB_SIZE - 1)]; id 0 is never handed out. */
+typedef struct NodeTable
+{
+    QueueNode **slabs;
+    unsigned int slabCount;
+    unsigned int slabCapacity;
+} NodeTable;
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    char *cursor;
+    char *end;
+} ArenaChunk;
+
+typedef struct ValueArena
+{
+    ArenaChunk *chunks;
+    ValueBlock *freeBlocks[VALUE_CLASS_COUNT];
+} ValueArena;
+
+typedef struct IndexSlot
+{
+    unsigned int hash;
+    unsigned int nodeId;
+} IndexSlot;
+
+typedef struct HashIndex
+{
+    IndexSlot *slots;
+    size_t mask;
+    size_t count;
+} HashIndex;
+
+typedef struct ReaderEpoch
+{
+    _Alignas(CACHE_LINE_SIZE) _Atomic unsigned long long epoch;
+} ReaderEpoch;
+
+/* A reader announces the global epoch while it runs; zero means it is outside the cache. */
+typedef struct EpochState
+{
+    _Alignas(CACHE_LINE_SIZE) _Atomic unsigned long long globalEpoch;
+    ReaderEpoch readers[EPOCH_MAX_READERS];
+} EpochState;
+
+/* Lossy ring of nodes hit by lock-free readers, replayed into the recency order by the lock holder. */
+typedef struct ReadBuffer
+{
+    _Alignas(CACHE_LINE_SIZE) _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+    QueueNode *_Atomic entries[READ_BUFFER_SIZE];
+} ReadBuffer;
+
+typedef enum
+{
+    RETIRED_NODE,
+    RETIRED_VALUE,
+    RETIRED_TABLE
+} RetiredKind;
+
+typedef struct RetiredObject
+{
+    void *pointer;
+    unsigned long long epoch;
+    RetiredKind kind;
+} RetiredObject;
+
+typedef struct RetireList
+{
+    RetiredObject *objects;
+    size_t count;
+    size_t capacity;
+} RetireList;
+
+typedef struct RecencyList
+{
+    QueueNode *head;
+    QueueNode *tail;
+    int count;
+    size_t weight;
+} RecencyList;
+
+typedef struct FrequencySketch
+{
+    unsigned char *counters;
+    size_t widthMask;
+    int additions;
+    int sampleSize;
+} FrequencySketch;
+
+/* Hierarchical timing wheel with 1 ms ticks; level L slots span 64^L ticks. */
+typedef struct TimerWheel
+{
+    long long currentTick;
+    int timerCount;
+    int levelCounts[WHEEL_LEVELS];
+    QueueNode *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+/* Log-linear latency buckets in nanoseconds: 16 sub-buckets per power of two, about 6% resolution. */
+typedef struct LatencyHistogram
+{
+    _Atomic unsigned long long counts[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+typedef struct ShardStats
+{
+    _Atomic unsigned long long hits;
+    _Atomic unsigned long long misses;
+    _Atomic unsigned long long inserts;
+    _Atomic unsigned long long updates;
+    _Atomic unsigned long long evictions;
+    _Atomic unsigned long long expirations;
+    _Atomic unsigned long long lookups;
+    _Atomic unsigned long long probes;
+    LatencyHistogram getLatency;
+    LatencyHistogram putLatency;
+} ShardStats;
+
+typedef struct CacheStats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long inserts;
+    unsigned long long updates;
+    unsigned long long evictions;
+    unsigned long long expirations;
+    unsigned long long entries;
+    double averageProbeLength;
+    unsigned long long getLatency[LATENCY_BUCKETS];
+    unsigned long long putLatency[LATENCY_BUCKETS];
+} CacheStats;
+
+/*
+ * LRU and CLOCK keep every entry in SEGMENT_RECENCY. W-TinyLFU uses it as the
+ * admission window and splits the main region into probation and protected.
+ * Weights are entry counts, or byte charges when the cache has a byte budget.
+ */
+typedef struct LruShard
+{
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    EvictionPolicy policy;
+    bool byteBudget;
+    int count;
+    size_t maxWeight;
+    size_t weight;
+    size_t windowMaxWeight;
+    size_t protectedMaxWeight;
+    RecencyList lists[SEGMENT_COUNT];
+    QueueNode *hand;
+    FrequencySketch sketch;
+    TimerWheel wheel;
+    ShardStats stats;
+    NodeSlab *nodeSlabs;
+    NodeTable nodes;
+    QueueNode *freeList;
+    ValueArena arena;
+    HashIndex index;
+    EpochState *epochs;
+    ReadBuffer *readBuffers;
+    RetireList retired;
+} LruShard;
+
+typedef struct LruCache
+{
+    int capacity;
+    size_t maxBytes;
+    int shardCount;
+    bool recordLatency;
+    EpochState *epochs;
+    LruShard *shards;
+} LruCache;
+
+typedef enum
+{
+    TRACE_UNIFORM,
+    TRACE_ZIPF,
+    TRACE_SCAN,
+    TRACE_FILE
+} TraceKind;
+
+typedef struct BenchOptions
+{
+    TraceKind trace;
+    const char *tracePath;
+    EvictionPolicy policy;
+    long long operations;
+    int keySpace;
+    double skew;
+    int scanPercent;
+    int scanLength;
+    int threadCounts[BENCH_MAX_RUNS];
+    int threadRuns;
+    int capacities[BENCH_MAX_RUNS];
+    int capacityRuns;
+    int shardCount;
+    bool lockFreeReads;
+} BenchOptions;
+
+typedef struct BenchWorker
+{
+    LruCache *cache;
+    const int *keys;
+    size_t count;
+} BenchWorker;
+
+CacheKey int64Key(long long value)
+{
+    CacheKey key = {KEY_INT64, value, NULL, 0};
+    return key;
+}
+
+CacheKey stringKey(const char *value)
+{
+    CacheKey key = {KEY_STRING, 0, value, strlen(value)};
+    return key;
+}
+
+unsigned long long mixHash(unsigned long long x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+unsigned long long hashCacheKey(const CacheKey *key)
+{
+    if (key->type == KEY_INT64)
+    {
+        return mixHash((unsigned long long)key->intValue);
+    }
+
+    const unsigned long long multiplier = 0xc6a4a7935bd1e995ULL;
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ (key->length * multiplier);
+    size_t offset = 0;
+    for (; offset + 8 <= key->length; offset += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, key->bytes + offset, sizeof(word));
+        word *= multiplier;
+        word ^= word >> 47;
+        hash = (hash ^ (word * multiplier)) * multiplier;
+    }
+    unsigned long long tail = 0;
+    memcpy(&tail, key->bytes + offset, key->length - offset);
+    return mixHash(hash ^ tail);
+}
+
+QueueNode *nodeAt(const NodeTable *nodes, unsigned int id)
+{
+    return id == NODE_NONE ? NULL : &nodes->slabs[id >> NODE_SLAB_BITS][id & (NODE_SLAB_SIZE - 1)];
+}
+
+unsigned int nodeId(const QueueNode *node)
+{
+    return node != NULL ? node->id : NODE_NONE;
+}
+
+bool nodeHasKey(const QueueNode *node, const CacheKey *key)
+{
+    if (node->keyType != key->type)
+    {
+        return false;
+    }
+    if (key->type == KEY_INT64)
+    {
+        return node->intKey == key->intValue;
+    }
+    return node->value->keyLength == key->length && memcmp(node->value->data, key->bytes, key->length) == 0;
+}
+
+char *nodeValue(const QueueNode *node)
+{
+    return node->value->data + node->value->keyLength;
+}
+
+size_t probeDistance(const HashIndex *index, size_t position, unsigned int hash)
+{
+    return (position - (hash & index->mask)) & index->mask;
+}
+
+void initIndex(HashIndex *index, size_t expectedEntries)
+{
+    size_t slotCount = INDEX_MIN_SLOTS;
+    while (slotCount * INDEX_MAX_LOAD_PERCENT / 100 < expectedEntries)
+    {
+        slotCount *= 2;
+    }
+    index->slots = (IndexSlot *)calloc(slotCount, sizeof(IndexSlot));
+    if (index->slots == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for hash index.\n");
+        exit(EXIT_FAILURE);
+    }
+    index->mask = slotCount - 1;
+    index->count = 0;
+}
+
+/* Slot writes are atomic so lock-free readers never see a torn node id. */
+void setSlot(IndexSlot *slot, unsigned int hash, unsigned int nodeId)
+{
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->nodeId, nodeId, __ATOMIC_RELEASE);
+}
+
+void placeInIndex(HashIndex *index, unsigned int hash, unsigned int nodeId)
+{
+    IndexSlot incoming = {hash, nodeId};
+    size_t position = hash & index->mask;
+    size_t distance = 0;
+
+    while (index->slots[position].nodeId != NODE_NONE)
+    {
+        size_t existingDistance = probeDistance(index, position, index->slots[position].hash);
+        if (existingDistance < distance)
+        {
+            IndexSlot displaced = index->slots[position];
+            setSlot(&index->slots[position], incoming.hash, incoming.nodeId);
+            incoming = displaced;
+            distance = existingDistance;
+        }
+        position = (position + 1) & index->mask;
+        distance++;
+    }
+    setSlot(&index->slots[position], incoming.hash, incoming.nodeId);
+    index->count++;
+}
+
+/*
+ * The doubled table is filled before it is published. The slots are stored before the mask, and readers load
+ * them in the opposite order, so a reader may pair the new slots with the old, smaller mask but never the reverse.
+ */
+IndexSlot *growIndex(HashIndex *index)
+{
+    IndexSlot *oldSlots = index->slots;
+    size_t oldSlotCount = index->mask + 1;
+    HashIndex grown;
+
+    grown.slots = (IndexSlot *)calloc(oldSlotCount * 2, sizeof(IndexSlot));
+    if (grown.slots == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed while growing hash index.\n");
+        exit(EXIT_FAILURE);
+    }
+    grown.mask = oldSlotCount * 2 - 1;
+    grown.count = 0;
+    for (size_t i = 0; i < oldSlotCount; i++)
+    {
+        if (oldSlots[i].nodeId != NODE_NONE)
+        {
+            placeInIndex(&grown, oldSlots[i].hash, oldSlots[i].nodeId);
+        }
+    }
+    __atomic_store_n(&index->slots, grown.slots, __ATOMIC_RELEASE);
+    __atomic_store_n(&index->mask, grown.mask, __ATOMIC_RELEASE);
+    index->count = grown.count;
+    return oldSlots;
+}
+
+/* Returns the slot array replaced by growth, or NULL; the caller decides when it can be freed. */
+IndexSlot *insertIntoIndex(HashIndex *index, QueueNode *node)
+{
+    IndexSlot *oldSlots = NULL;
+    if ((index->count + 1) * 100 > (index->mask + 1) * INDEX_MAX_LOAD_PERCENT)
+    {
+        oldSlots = growIndex(index);
+    }
+    placeInIndex(index, node->hash, node->id);
+    return oldSlots;
+}
+
+QueueNode *findInIndex(const HashIndex *index, const NodeTable *nodes, const CacheKey *key, unsigned int hash, size_t *probes)
+{
+    size_t position = hash & index->mask;
+    size_t distance = 0;
+    QueueNode *found = NULL;
+
+    while (index->slots[position].nodeId != NODE_NONE)
+    {
+        const IndexSlot *slot = &index->slots[position];
+        if (probeDistance(index, position, slot->hash) < distance)
+        {
+            break;
+        }
+        if (slot->hash == hash && nodeHasKey(nodeAt(nodes, slot->nodeId), key))
+        {
+            found = nodeAt(nodes, slot->nodeId);
+            break;
+        }
+        position = (position + 1) & index->mask;
+        distance++;
+    }
+    *probes = distance + 1;
+    return found;
+}
+
+/*
+ * Concurrent backward shifts can hide an entry for a moment; that only shows up as a miss. Node slabs
+ * live as long as the cache, so only the slab directory itself needs an atomic load.
+ */
+QueueNode *findInIndexLockFree(const HashIndex *index, const NodeTable *nodes, const CacheKey *key, unsigned int hash, size_t *probes)
+{
+    size_t mask = __atomic_load_n(&index->mask, __ATOMIC_ACQUIRE);
+    IndexSlot *slots = __atomic_load_n(&index->slots, __ATOMIC_ACQUIRE);
+    size_t position = hash & mask;
+    size_t distance = 0;
+    QueueNode *found = NULL;
+    unsigned int id;
+
+    while (distance <= mask && (id = __atomic_load_n(&slots[position].nodeId, __ATOMIC_ACQUIRE)) != NODE_NONE)
+    {
+        unsigned int slotHash = __atomic_load_n(&slots[position].hash, __ATOMIC_RELAXED);
+        if (((position - (slotHash & mask)) & mask) < distance)
+        {
+            break;
+        }
+        if (slotHash == hash)
+        {
+            QueueNode **slabs = __atomic_load_n(&nodes->slabs, __ATOMIC_ACQUIRE);
+            QueueNode *node = &slabs[id >> NODE_SLAB_BITS][id & (NODE_SLAB_SIZE - 1)];
+            const ValueBlock *block = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+            if (node->hash == hash && node->keyType == key->type && (key->type == KEY_INT64 ? node->intKey == key->intValue : block->keyLength == key->length && memcmp(block->data, key->bytes, key->length) == 0))
+            {
+                found = node;
+                break;
+            }
+        }
+        position = (position + 1) & mask;
+        distance++;
+    }
+    *probes = distance + 1;
+    return found;
+}
+
+void removeFromIndex(HashIndex *index, const QueueNode *targetNode)
+{
+    size_t position = targetNode->hash & index->mask;
+    while (index->slots[position].nodeId != targetNode->id)
+    {
+        if (index->slots[position].nodeId == NODE_NONE)
+        {
+            return;
+        }
+        position = (position + 1) & index->mask;
+    }
+
+    size_t next = (position + 1) & index->mask;
+    while (index->slots[next].nodeId != NODE_NONE && probeDistance(index, next, index->slots[next].hash) != 0)
+    {
+        setSlot(&index->slots[position], index->slots[next].hash, index->slots[next].nodeId);
+        position = next;
+        next = (next + 1) & index->mask;
+    }
+    __atomic_store_n(&index->slots[position].nodeId, NODE_NONE, __ATOMIC_RELEASE);
+    index->count--;
+}
+
+void initSketch(FrequencySketch *sketch, int expectedEntries)
+{
+    size_t width = 16;
+    while (width < (size_t)expectedEntries)
+    {
+        width *= 2;
+    }
+    sketch->counters = (unsigned char *)calloc(width * SKETCH_DEPTH, sizeof(unsigned char));
+    if (sketch->counters == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for frequency sketch.\n");
+        exit(EXIT_FAILURE);
+    }
+    sketch->widthMask = width - 1;
+    sketch->additions = 0;
+    /* A tiny or zero expected size must not halve the counters on every addition. */
+    sketch->sampleSize = expectedEntries * SKETCH_SAMPLE_FACTOR;
+    if (sketch->sampleSize < (int)width)
+    {
+        sketch->sampleSize = (int)width;
+    }
+}
+
+size_t sketchPosition(const FrequencySketch *sketch, unsigned int hash, int row)
+{
+    unsigned int step = ((hash >> 16) | (hash << 16)) * 0x85ebca6bU | 1U;
+    return (size_t)row * (sketch->widthMask + 1) + ((hash + (unsigned int)row * step) & sketch->widthMask);
+}
+
+void recordFrequency(FrequencySketch *sketch, unsigned int hash)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        unsigned char *counter = &sketch->counters[sketchPosition(sketch, hash, row)];
+        if (*counter < SKETCH_MAX_COUNT)
+        {
+            (*counter)++;
+        }
+    }
+
+    if (++sketch->additions >= sketch->sampleSize)
+    {
+        for (size_t i = 0; i < (sketch->widthMask + 1) * SKETCH_DEPTH; i++)
+        {
+            sketch->counters[i] >>= 1;
+        }
+        sketch->additions /= 2;
+    }
+}
+
+int estimateFrequency(const FrequencySketch *sketch, unsigned int hash)
+{
+    int frequency = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        int count = sketch->counters[sketchPosition(sketch, hash, row)];
+        if (count < frequency)
+        {
+            frequency = count;
+        }
+    }
+    return frequency;
+}
+
+int valueClassFor(size_t blockSize)
+{
+    if (blockSize <= 64)
+    {
+        return blockSize <= 16 ? 0 : (int)((blockSize + 7) / 8) - 2;
+    }
+    int shift = 63 - __builtin_clzll((unsigned long long)(blockSize - 1));
+    size_t step = (size_t)1 << (shift - 2);
+    int subClass = (int)((blockSize - 1 - ((size_t)1 << shift)) / step);
+    int sizeClass = 7 + (shift - 6) * 4 + subClass;
+    return sizeClass < VALUE_CLASS_COUNT ? sizeClass : LARGE_VALUE_CLASS;
+}
+
+size_t valueClassSize(int sizeClass)
+{
+    if (sizeClass <= 6)
+    {
+        return 16 + (size_t)sizeClass * 8;
+    }
+    int shift = 6 + (sizeClass - 7) / 4;
+    int subClass = (sizeClass - 7) % 4;
+    return ((size_t)1 << shift) + (size_t)(subClass + 1) * ((size_t)1 << (shift - 2));
+}
+
+size_t valueBlockSize(size_t payloadLength)
+{
+    size_t blockSize = sizeof(ValueBlock) + payloadLength + 1;
+    int sizeClass = valueClassFor(blockSize);
+    return sizeClass == LARGE_VALUE_CLASS ? blockSize : valueClassSize(sizeClass);
+}
+
+void carveArenaRemainder(ValueArena *arena, ArenaChunk *chunk)
+{
+    for (int sizeClass = VALUE_CLASS_COUNT - 1; sizeClass >= 0; sizeClass--)
+    {
+        size_t classSize = valueClassSize(sizeClass);
+        while ((size_t)(chunk->end - chunk->cursor) >= classSize)
+        {
+            ValueBlock *block = (ValueBlock *)chunk->cursor;
+            chunk->cursor += classSize;
+            *(ValueBlock **)block = arena->freeBlocks[sizeClass];
+            arena->freeBlocks[sizeClass] = block;
+        }
+    }
+}
+
+ValueBlock *allocateValueBlock(ValueArena *arena, size_t payloadLength)
+{
+    size_t blockSize = sizeof(ValueBlock) + payloadLength + 1;
+    int sizeClass = valueClassFor(blockSize);
+    ValueBlock *block;
+
+    if (sizeClass == LARGE_VALUE_CLASS)
+    {
+        block = (ValueBlock *)malloc(blockSize);
+        if (block == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for large value.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (arena->freeBlocks[sizeClass] != NULL)
+    {
+        block = arena->freeBlocks[sizeClass];
+        arena->freeBlocks[sizeClass] = *(ValueBlock **)block;
+    }
+    else
+    {
+        size_t classSize = valueClassSize(sizeClass);
+        ArenaChunk *chunk = arena->chunks;
+        if (chunk == NULL || (size_t)(chunk->end - chunk->cursor) < classSize)
+        {
+            if (chunk != NULL)
+            {
+                carveArenaRemainder(arena, chunk);
+            }
+            chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + ARENA_CHUNK_SIZE);
+            if (chunk == NULL)
+            {
+                fprintf(stderr, "Error: Memory allocation failed for value arena.\n");
+                exit(EXIT_FAILURE);
+            }
+            chunk->cursor = (char *)(chunk + 1);
+            chunk->end = chunk->cursor + ARENA_CHUNK_SIZE;
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+        block = (ValueBlock *)chunk->cursor;
+        chunk->cursor += classSize;
+    }
+
+    block->sizeClass = (unsigned char)sizeClass;
+    return block;
+}
+
+void freeValueBlock(ValueArena *arena, ValueBlock *block)
+{
+    if (block->sizeClass == LARGE_VALUE_CLASS)
+    {
+        free(block);
+        return;
+    }
+    int sizeClass = block->sizeClass;
+    *(ValueBlock **)block = arena->freeBlocks[sizeClass];
+    arena->freeBlocks[sizeClass] = block;
+}
+
+void detachNode(const NodeTable *nodes, RecencyList *list, QueueNode *node)
+{
+    if (node->prev != NODE_NONE)
+    {
+        nodeAt(nodes, node->prev)->next = node->next;
+    }
+    else
+    {
+        list->head = nodeAt(nodes, node->next);
+    }
+
+    if (node->next != NODE_NONE)
+    {
+        nodeAt(nodes, node->next)->prev = node->prev;
+    }
+    else
+    {
+        list->tail = nodeAt(nodes, node->prev);
+    }
+    list->count--;
+    list->weight -= node->charge;
+}
+
+void countEvent(_Atomic unsigned long long *counter, unsigned long long amount)
+{
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+long long monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int latencyBucket(unsigned long long nanos)
+{
+    if (nanos < LATENCY_SUB_BUCKETS)
+    {
+        return (int)nanos;
+    }
+    int magnitude = 63 - __builtin_clzll(nanos);
+    int subBucket = (int)((nanos >> (magnitude - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    int bucket = (magnitude - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + subBucket;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+unsigned long long latencyBucketValue(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+    {
+        return (unsigned long long)bucket;
+    }
+    int magnitude = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    unsigned long long subBucket = (unsigned long long)(bucket % LATENCY_SUB_BUCKETS);
+    return (LATENCY_SUB_BUCKETS + subBucket) << (magnitude - LATENCY_SUB_BUCKET_BITS);
+}
+
+void recordLatency(LatencyHistogram *histogram, long long startNanos)
+{
+    if (startNanos != 0)
+    {
+        countEvent(&histogram->counts[latencyBucket((unsigned long long)(monotonicNanos() - startNanos))], 1);
+    }
+}
+
+void insertAtHead(RecencyList *list, QueueNode *node)
+{
+    node->next = nodeId(list->head);
+    node->prev = NODE_NONE;
+
+    if (list->head != NULL)
+    {
+        list->head->prev = node->id;
+    }
+
+    list->head = node;
+
+    if (list->tail == NULL)
+    {
+        list->tail = node;
+    }
+    list->count++;
+    list->weight += node->charge;
+}
+
+void insertAfter(const NodeTable *nodes, RecencyList *list, QueueNode *position, QueueNode *node)
+{
+    node->prev = position->id;
+    node->next = position->next;
+
+    if (position->next != NODE_NONE)
+    {
+        nodeAt(nodes, position->next)->prev = node->id;
+    }
+    else
+    {
+        list->tail = node;
+    }
+
+    position->next = node->id;
+    list->count++;
+    list->weight += node->charge;
+}
+
+void moveToSegment(LruShard *shard, QueueNode *node, Segment segment)
+{
+    detachNode(&shard->nodes, &shard->lists[node->segment], node);
+    node->segment = (unsigned char)segment;
+    insertAtHead(&shard->lists[segment], node);
+}
+
+void pushFreeNode(LruShard *shard, QueueNode *node)
+{
+    node->next = nodeId(shard->freeList);
+    shard->freeList = node;
+}
+
+/* Bit i is set while a thread owns reader slot i; the slot is given back when the thread exits. */
+_Atomic unsigned long long claimedReaderSlots[READER_SLOT_WORDS];
+_Thread_local int readerSlot = -1;
+pthread_key_t readerSlotKey;
+pthread_once_t readerSlotKeyOnce = PTHREAD_ONCE_INIT;
+
+/* A thread only exits outside the cache, so its slot's epoch is already zero for every cache. */
+void releaseReaderSlot(void *value)
+{
+    int slot = (int)(intptr_t)value - 1;
+    atomic_fetch_and(&claimedReaderSlots[slot / 64], ~(1ULL << (slot % 64)));
+}
+
+void createReaderSlotKey()
+{
+    pthread_key_create(&readerSlotKey, releaseReaderSlot);
+}
+
+/* Threads beyond EPOCH_MAX_READERS alive at once get no slot and fall back to locked reads. */
+int currentReaderSlot()
+{
+    if (readerSlot >= 0)
+    {
+        return readerSlot;
+    }
+    pthread_once(&readerSlotKeyOnce, createReaderSlotKey);
+    for (int word = 0; word < READER_SLOT_WORDS; word++)
+    {
+        unsigned long long claimed = atomic_load(&claimedReaderSlots[word]);
+        while (claimed != ~0ULL)
+        {
+            int bit = __builtin_ctzll(~claimed);
+            if (atomic_compare_exchange_weak(&claimedReaderSlots[word], &claimed, claimed | (1ULL << bit)))
+            {
+                readerSlot = word * 64 + bit;
+                pthread_setspecific(readerSlotKey, (void *)(intptr_t)(readerSlot + 1));
+                return readerSlot;
+            }
+        }
+    }
+    return -1;
+}
+
+void enterEpoch(EpochState *epochs, int slot)
+{
+    atomic_store(&epochs->readers[slot].epoch, atomic_load(&epochs->globalEpoch));
+}
+
+void exitEpoch(EpochState *epochs, int slot)
+{
+    atomic_store_explicit(&epochs->readers[slot].epoch, 0, memory_order_release);
+}
+
+/* The epoch only moves once every active reader has observed the current one. */
+unsigned long long tryAdvanceEpoch(EpochState *epochs)
+{
+    unsigned long long current = atomic_load(&epochs->globalEpoch);
+    for (int word = 0; word < READER_SLOT_WORDS; word++)
+    {
+        for (unsigned long long claimed = atomic_load(&claimedReaderSlots[word]); claimed != 0; claimed &= claimed - 1)
+        {
+            int slot = word * 64 + __builtin_ctzll(claimed);
+            unsigned long long observed = atomic_load(&epochs->readers[slot].epoch);
+            if (observed != 0 && observed != current)
+            {
+                return current;
+            }
+        }
+    }
+    atomic_compare_exchange_strong(&epochs->globalEpoch, &current, current + 1);
+    return atomic_load(&epochs->globalEpoch);
+}
+
+void retireObject(LruShard *shard, void *pointer, RetiredKind kind)
+{
+    RetireList *retired = &shard->retired;
+    if (retired->count == retired->capacity)
+    {
+        retired->capacity = retired->capacity > 0 ? retired->capacity * 2 : RETIRE_BATCH_SIZE * 2;
+        retired->objects = (RetiredObject *)realloc(retired->objects, retired->capacity * sizeof(RetiredObject));
+        if (retired->objects == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for retire list.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    RetiredObject *object = &retired->objects[retired->count++];
+    object->pointer = pointer;
+    object->epoch = atomic_load(&shard->epochs->globalEpoch);
+    object->kind = kind;
+}
+
+/* Anything retired two epochs ago can no longer be held by a reader. */
+void reclaimRetired(LruShard *shard)
+{
+    RetireList *retired = &shard->retired;
+    unsigned long long safeEpoch = tryAdvanceEpoch(shard->epochs);
+    size_t kept = 0;
+
+    for (size_t i = 0; i < retired->count; i++)
+    {
+        RetiredObject *object = &retired->objects[i];
+        if (object->epoch + 2 > safeEpoch)
+        {
+            retired->objects[kept++] = *object;
+        }
+        else if (object->kind == RETIRED_NODE)
+        {
+            QueueNode *node = (QueueNode *)object->pointer;
+            freeValueBlock(&shard->arena, node->value);
+            pushFreeNode(shard, node);
+        }
+        else if (object->kind == RETIRED_VALUE)
+        {
+            freeValueBlock(&shard->arena, (ValueBlock *)object->pointer);
+        }
+        else
+        {
+            free(object->pointer);
+        }
+    }
+    retired->count = kept;
+}
+
+/* With lock-free readers, an evicted node keeps its value block until no reader can still be looking at it. */
+void recycleNode(LruShard *shard, QueueNode *node)
+{
+    if (shard->epochs != NULL)
+    {
+        retireObject(shard, node, RETIRED_NODE);
+    }
+    else
+    {
+        pushFreeNode(shard, node);
+    }
+}
+
+void growNodeTable(LruShard *shard, unsigned int slabsNeeded)
+{
+    NodeTable *table = &shard->nodes;
+    if (slabsNeeded > (1U << (32 - NODE_SLAB_BITS)))
+    {
+        fprintf(stderr, "Error: Too many QueueNodes for 32-bit ids.\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int capacity = table->slabCapacity > 0 ? table->slabCapacity : 16;
+    while (capacity < slabsNeeded)
+    {
+        capacity *= 2;
+    }
+    QueueNode **slabs = (QueueNode **)malloc(capacity * sizeof(QueueNode *));
+    if (slabs == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for QueueNode table.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (table->slabCount > 0)
+    {
+        memcpy(slabs, table->slabs, table->slabCount * sizeof(QueueNode *));
+    }
+
+    QueueNode **oldSlabs = table->slabs;
+    __atomic_store_n(&table->slabs, slabs, __ATOMIC_RELEASE);
+    table->slabCapacity = capacity;
+    if (oldSlabs != NULL && shard->epochs != NULL)
+    {
+        retireObject(shard, oldSlabs, RETIRED_TABLE);
+    }
+    else
+    {
+        free(oldSlabs);
+    }
+}
+
+/* A slab may span several table entries; every slab starts on a fresh NODE_SLAB_SIZE boundary of the id space. */
+void addNodeSlab(LruShard *shard, size_t nodeCount)
+{
+    NodeTable *table = &shard->nodes;
+    size_t firstId = (size_t)table->slabCount << NODE_SLAB_BITS;
+    size_t reserved = firstId == 0 ? 1 : 0;
+    size_t slabCount = (nodeCount + reserved + NODE_SLAB_SIZE - 1) >> NODE_SLAB_BITS;
+    if (table->slabCount + slabCount > table->slabCapacity)
+    {
+        growNodeTable(shard, (unsigned int)(table->slabCount + slabCount));
+    }
+
+    NodeSlab *slab = (NodeSlab *)aligned_alloc(CACHE_LINE_SIZE, sizeof(NodeSlab) + (nodeCount + reserved) * sizeof(QueueNode));
+    if (slab == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for QueueNode pool.\n");
+        exit(EXIT_FAILURE);
+    }
+    slab->next = shard->nodeSlabs;
+    shard->nodeSlabs = slab;
+    for (size_t i = 0; i < slabCount; i++)
+    {
+        table->slabs[table->slabCount + i] = &slab->nodes[i << NODE_SLAB_BITS];
+    }
+    table->slabCount += (unsigned int)slabCount;
+
+    for (size_t i = nodeCount + reserved; i > reserved; i--)
+    {
+        slab->nodes[i - 1].id = (unsigned int)(firstId + i - 1);
+        pushFreeNode(shard, &slab->nodes[i - 1]);
+    }
+}
+
+QueueNode *popFreeNode(LruShard *shard)
+{
+    if (shard->freeList == NULL)
+    {
+        addNodeSlab(shard, NODE_SLAB_SIZE);
+    }
+    QueueNode *node = shard->freeList;
+    shard->freeList = nodeAt(&shard->nodes, node->next);
+    return node;
+}
+
+long long monotonicMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void scheduleTimer(const NodeTable *nodes, TimerWheel *wheel, QueueNode *node)
+{
+    long long span = 1LL << (WHEEL_SLOT_BITS * WHEEL_LEVELS);
+    long long placement = node->expiresAt - wheel->currentTick < span ? node->expiresAt : wheel->currentTick + span - 1;
+    long long delta = placement - wheel->currentTick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_SLOT_BITS * (level + 1)))
+    {
+        level++;
+    }
+    int slot = (int)((placement >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1));
+
+    node->timerLevel = (unsigned char)level;
+    node->timerSlot = (unsigned char)slot;
+    node->timerPrev = NODE_NONE;
+    node->timerNext = nodeId(wheel->slots[level][slot]);
+    if (node->timerNext != NODE_NONE)
+    {
+        nodeAt(nodes, node->timerNext)->timerPrev = node->id;
+    }
+    wheel->slots[level][slot] = node;
+    wheel->levelCounts[level]++;
+    wheel->timerCount++;
+}
+
+void unscheduleTimer(const NodeTable *nodes, TimerWheel *wheel, QueueNode *node)
+{
+    if (node->timerPrev != NODE_NONE)
+    {
+        nodeAt(nodes, node->timerPrev)->timerNext = node->timerNext;
+    }
+    else
+    {
+        wheel->slots[node->timerLevel][node->timerSlot] = nodeAt(nodes, node->timerNext);
+    }
+    if (node->timerNext != NODE_NONE)
+    {
+        nodeAt(nodes, node->timerNext)->timerPrev = node->timerPrev;
+    }
+    wheel->levelCounts[node->timerLevel]--;
+    wheel->timerCount--;
+}
+
+size_t entryCharge(const LruShard *shard, size_t payloadLength)
+{
+    return shard->byteBudget ? sizeof(QueueNode) + valueBlockSize(payloadLength) : 1;
+}
+
+void releaseEntry(LruShard *shard, QueueNode *node)
+{
+    if (node->expiresAt != 0)
+    {
+        unscheduleTimer(&shard->nodes, &shard->wheel, node);
+    }
+    removeFromIndex(&shard->index, node);
+    if (shard->epochs == NULL)
+    {
+        freeValueBlock(&shard->arena, node->value);
+    }
+    node->resident = false;
+    shard->weight -= node->charge;
+    shard->count--;
+}
+
+QueueNode *nextHandPosition(LruShard *shard, QueueNode *node)
+{
+    return node->prev != NODE_NONE ? nodeAt(&shard->nodes, node->prev) : shard->lists[SEGMENT_RECENCY].tail;
+}
+
+void unlinkNode(LruShard *shard, QueueNode *node)
+{
+    if (shard->hand == node)
+    {
+        shard->hand = shard->lists[SEGMENT_RECENCY].count > 1 ? nextHandPosition(shard, node) : NULL;
+    }
+    detachNode(&shard->nodes, &shard->lists[node->segment], node);
+}
+
+void evictNode(LruShard *shard, QueueNode *node)
+{
+    unlinkNode(shard, node);
+    releaseEntry(shard, node);
+    recycleNode(shard, node);
+}
+
+void cascadeTimers(const NodeTable *nodes, TimerWheel *wheel, int level, int slot)
+{
+    QueueNode *node = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (node != NULL)
+    {
+        QueueNode *next = nodeAt(nodes, node->timerNext);
+        wheel->levelCounts[level]--;
+        wheel->timerCount--;
+        scheduleTimer(nodes, wheel, node);
+        node = next;
+    }
+}
+
+void advanceTimerWheel(LruShard *shard, long long now)
+{
+    TimerWheel *wheel = &shard->wheel;
+    while (wheel->currentTick < now)
+    {
+        if (wheel->timerCount == 0)
+        {
+            wheel->currentTick = now;
+            return;
+        }
+
+        long long nextTick = wheel->currentTick + 1;
+        for (int level = 0; level < WHEEL_LEVELS && wheel->levelCounts[level] == 0; level++)
+        {
+            int shift = WHEEL_SLOT_BITS * (level + 1);
+            nextTick = ((wheel->currentTick >> shift) + 1) << shift;
+        }
+        if (nextTick > now)
+        {
+            wheel->currentTick = now;
+            return;
+        }
+        wheel->currentTick = nextTick;
+
+        int topLevel = 0;
+        while (topLevel < WHEEL_LEVELS - 1 && (nextTick & ((1LL << (WHEEL_SLOT_BITS * (topLevel + 1))) - 1)) == 0)
+        {
+            topLevel++;
+        }
+        for (int level = topLevel; level > 0; level--)
+        {
+            cascadeTimers(&shard->nodes, wheel, level, (int)((nextTick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)));
+        }
+
+        QueueNode **expired = &wheel->slots[0][nextTick & (WHEEL_SLOTS - 1)];
+        while (*expired != NULL)
+        {
+            evictNode(shard, *expired);
+            countEvent(&shard->stats.expirations, 1);
+        }
+    }
+}
+
+bool needsRoom(const LruShard *shard, size_t charge)
+{
+    return shard->count > 0 && shard->weight + charge > shard->maxWeight;
+}
+
+QueueNode *sweepClock(LruShard *shard)
+{
+    while (shard->hand->referenced)
+    {
+        shard->hand->referenced = false;
+        shard->hand = nextHandPosition(shard, shard->hand);
+    }
+    QueueNode *victim = shard->hand;
+    shard->hand = nextHandPosition(shard, victim);
+    return victim;
+}
+
+void admitFromWindow(LruShard *shard, size_t charge)
+{
+    RecencyList *window = &shard->lists[SEGMENT_RECENCY];
+    RecencyList *probation = &shard->lists[SEGMENT_PROBATION];
+    int candidates = 0;
+
+    while (window->count > 0 && window->weight + charge > shard->windowMaxWeight)
+    {
+        moveToSegment(shard, window->tail, SEGMENT_PROBATION);
+        candidates++;
+    }
+
+    while (needsRoom(shard, charge))
+    {
+        QueueNode *candidate = candidates > 0 ? probation->head : NULL;
+        QueueNode *victim = probation->tail;
+        if (victim == NULL)
+        {
+            victim = shard->lists[SEGMENT_PROTECTED].tail;
+        }
+        if (victim == NULL)
+        {
+            victim = window->tail;
+        }
+
+        countEvent(&shard->stats.evictions, 1);
+        if (candidate == NULL || candidate == victim)
+        {
+            candidates -= candidate != NULL ? 1 : 0;
+            evictNode(shard, victim);
+        }
+        else if (estimateFrequency(&shard->sketch, candidate->hash) > estimateFrequency(&shard->sketch, victim->hash))
+        {
+            evictNode(shard, victim);
+        }
+        else
+        {
+            candidates--;
+            evictNode(shard, candidate);
+        }
+    }
+}
+
+void promoteToProtected(LruShard *shard, QueueNode *node)
+{
+    moveToSegment(shard, node, SEGMENT_PROTECTED);
+    while (shard->lists[SEGMENT_PROTECTED].weight > shard->protectedMaxWeight && shard->lists[SEGMENT_PROTECTED].tail != node)
+    {
+        moveToSegment(shard, shard->lists[SEGMENT_PROTECTED].tail, SEGMENT_PROBATION);
+    }
+}
+
+QueueNode *allocateNode(LruShard *shard, size_t charge)
+{
+    RecencyList *recency = &shard->lists[SEGMENT_RECENCY];
+    QueueNode *node = NULL;
+
+    if (shard->policy == EVICTION_WTINYLFU)
+    {
+        admitFromWindow(shard, charge);
+    }
+    else if (shard->policy == EVICTION_CLOCK)
+    {
+        while (needsRoom(shard, charge))
+        {
+            if (node != NULL)
+            {
+                unlinkNode(shard, node);
+                recycleNode(shard, node);
+            }
+            node = sweepClock(shard);
+            releaseEntry(shard, node);
+            countEvent(&shard->stats.evictions, 1);
+        }
+        if (node != NULL && shard->epochs != NULL)
+        {
+            unlinkNode(shard, node);
+            recycleNode(shard, node);
+        }
+        else if (node != NULL)
+        {
+            recency->weight += charge - node->charge;
+            node->charge = charge;
+            return node;
+        }
+    }
+    else
+    {
+        while (needsRoom(shard, charge))
+        {
+            evictNode(shard, recency->tail);
+            countEvent(&shard->stats.evictions, 1);
+        }
+    }
+
+    node = popFreeNode(shard);
+    node->charge = charge;
+    node->segment = SEGMENT_RECENCY;
+    if (shard->policy == EVICTION_CLOCK && shard->hand != NULL)
+    {
+        insertAfter(&shard->nodes, recency, shard->hand, node);
+    }
+    else
+    {
+        insertAtHead(recency, node);
+        if (shard->policy == EVICTION_CLOCK)
+        {
+            shard->hand = node;
+        }
+    }
+    return node;
+}
+
+void initShard(LruShard *shard, const CacheConfig *config, size_t maxWeight)
+{
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->policy = config->policy;
+    shard->byteBudget = config->maxBytes > 0;
+    shard->count = 0;
+    shard->maxWeight = maxWeight;
+    shard->weight = 0;
+    shard->windowMaxWeight = maxWeight * WINDOW_PERCENT / 100;
+    if (shard->windowMaxWeight < 1)
+    {
+        shard->windowMaxWeight = 1;
+    }
+    shard->protectedMaxWeight = (maxWeight - shard->windowMaxWeight) * PROTECTED_PERCENT / 100;
+    for (int i = 0; i < SEGMENT_COUNT; i++)
+    {
+        shard->lists[i].head = NULL;
+        shard->lists[i].tail = NULL;
+        shard->lists[i].count = 0;
+        shard->lists[i].weight = 0;
+    }
+    shard->hand = NULL;
+    memset(&shard->wheel, 0, sizeof(shard->wheel));
+    shard->wheel.currentTick = monotonicMillis();
+    memset(&shard->stats, 0, sizeof(shard->stats));
+    shard->nodeSlabs = NULL;
+    memset(&shard->nodes, 0, sizeof(shard->nodes));
+    shard->freeList = NULL;
+    memset(&shard->arena, 0, sizeof(shard->arena));
+    shard->epochs = NULL;
+    memset(&shard->retired, 0, sizeof(shard->retired));
+
+    size_t expectedEntries = shard->byteBudget ? maxWeight / (sizeof(QueueNode) + EXPECTED_VALUE_BYTES) : maxWeight;
+    if (!shard->byteBudget)
+    {
+        addNodeSlab(shard, maxWeight);
+    }
+    initIndex(&shard->index, shard->byteBudget ? 0 : expectedEntries);
+    shard->sketch.counters = NULL;
+    if (shard->policy == EVICTION_WTINYLFU)
+    {
+        initSketch(&shard->sketch, (int)expectedEntries);
+    }
+
+    shard->readBuffers = NULL;
+    if (config->lockFreeReads)
+    {
+        shard->readBuffers = (ReadBuffer *)aligned_alloc(CACHE_LINE_SIZE, READ_BUFFER_STRIPES * sizeof(ReadBuffer));
+        if (shard->readBuffers == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for read buffers.\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(shard->readBuffers, 0, READ_BUFFER_STRIPES * sizeof(ReadBuffer));
+    }
+}
+
+void freeShard(LruShard *shard)
+{
+    pthread_mutex_destroy(&shard->lock);
+    for (int i = 0; i < SEGMENT_COUNT; i++)
+    {
+        for (QueueNode *node = shard->lists[i].head; node != NULL; node = nodeAt(&shard->nodes, node->next))
+        {
+            if (node->value->sizeClass == LARGE_VALUE_CLASS)
+            {
+                free(node->value);
+            }
+        }
+    }
+    for (size_t i = 0; i < shard->retired.count; i++)
+    {
+        RetiredObject *object = &shard->retired.objects[i];
+        if (object->kind == RETIRED_TABLE)
+        {
+            free(object->pointer);
+            continue;
+        }
+        ValueBlock *block = object->kind == RETIRED_NODE ? ((QueueNode *)object->pointer)->value : (ValueBlock *)object->pointer;
+        if (block->sizeClass == LARGE_VALUE_CLASS)
+        {
+            free(block);
+        }
+    }
+    free(shard->retired.objects);
+    free(shard->readBuffers);
+    while (shard->arena.chunks != NULL)
+    {
+        ArenaChunk *next = shard->arena.chunks->next;
+        free(shard->arena.chunks);
+        shard->arena.chunks = next;
+    }
+    while (shard->nodeSlabs != NULL)
+    {
+        NodeSlab *next = shard->nodeSlabs->next;
+        free(shard->nodeSlabs);
+        shard->nodeSlabs = next;
+    }
+    free(shard->nodes.slabs);
+    free(shard->index.slots);
+    free(shard->sketch.counters);
+}
+
+void freeCache(LruCache *cache)
+{
+    for (int i = 0; i < cache->shardCount; i++)
+    {
+        freeShard(&cache->shards[i]);
+    }
+    free(cache->shards);
+    free(cache->epochs);
+    free(cache);
+}
+
+LruCache *createCacheWithConfig(const CacheConfig *config)
+{
+    int shardCount = config->shardCount;
+    size_t totalWeight = config->maxBytes > 0 ? config->maxBytes : (size_t)(config->capacity > 0 ? config->capacity : 0);
+    if (totalWeight == 0 || shardCount <= 0 || (size_t)shardCount > totalWeight)
+    {
+        return NULL;
+    }
+    LruCache *newCache = (LruCache *)malloc(sizeof(LruCache));
+    if (newCache == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for LruCache.\n");
+        exit(EXIT_FAILURE);
+    }
+    newCache->capacity = config->capacity;
+    newCache->maxBytes = config->maxBytes;
+    newCache->shardCount = shardCount;
+    newCache->recordLatency = config->recordLatency;
+    newCache->shards = (LruShard *)aligned_alloc(CACHE_LINE_SIZE, (size_t)shardCount * sizeof(LruShard));
+    if (newCache->shards == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for cache shards.\n");
+        exit(EXIT_FAILURE);
+    }
+    newCache->epochs = NULL;
+    if (config->lockFreeReads)
+    {
+        newCache->epochs = (EpochState *)aligned_alloc(CACHE_LINE_SIZE, sizeof(EpochState));
+        if (newCache->epochs == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for reader epochs.\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(newCache->epochs, 0, sizeof(EpochState));
+        atomic_store(&newCache->epochs->globalEpoch, 1);
+    }
+    for (int i = 0; i < shardCount; i++)
+    {
+        size_t shardWeight = totalWeight / shardCount + ((size_t)i < totalWeight % shardCount ? 1 : 0);
+        initShard(&newCache->shards[i], config, shardWeight);
+        newCache->shards[i].epochs = newCache->epochs;
+    }
+    return newCache;
+}
+
+LruCache *createShardedCache(int capacity, int shardCount)
+{
+    CacheConfig config = {capacity, 0, shardCount, EVICTION_LRU, false, false};
+    return createCacheWithConfig(&config);
+}
+
+LruCache *createCache(int capacity)
+{
+    return createShardedCache(capacity, 1);
+}
+
+LruShard *shardForHash(LruCache *cache, unsigned long long hash)
+{
+    return &cache->shards[((hash >> 32) * (unsigned int)cache->shardCount) >> 32];
+}
+
+void expireDueEntries(LruShard *shard, bool needsCurrentTime)
+{
+    if (needsCurrentTime || shard->wheel.timerCount > 0)
+    {
+        advanceTimerWheel(shard, monotonicMillis());
+    }
+}
+
+void setEntryExpiry(LruShard *shard, QueueNode *node, long long ttlMillis)
+{
+    if (node->expiresAt != 0)
+    {
+        unscheduleTimer(&shard->nodes, &shard->wheel, node);
+    }
+    __atomic_store_n(&node->expiresAt, ttlMillis > 0 ? shard->wheel.currentTick + ttlMillis : 0, __ATOMIC_RELAXED);
+    if (node->expiresAt != 0)
+    {
+        scheduleTimer(&shard->nodes, &shard->wheel, node);
+    }
+}
+
+void expireCache(LruCache *cache)
+{
+    for (int i = 0; i < cache->shardCount; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        expireDueEntries(&cache->shards[i], false);
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+void touchNode(LruShard *shard, QueueNode *node)
+{
+    if (shard->policy == EVICTION_CLOCK)
+    {
+        node->referenced = true;
+    }
+    else if (node->segment == SEGMENT_PROBATION)
+    {
+        promoteToProtected(shard, node);
+    }
+    else
+    {
+        moveToSegment(shard, node, (Segment)node->segment);
+    }
+}
+
+QueueNode *touchKey(LruShard *shard, const CacheKey *key, unsigned int hash)
+{
+    if (shard->policy == EVICTION_WTINYLFU)
+    {
+        recordFrequency(&shard->sketch, hash);
+    }
+
+    size_t probes;
+    QueueNode *node = findInIndex(&shard->index, &shard->nodes, key, hash, &probes);
+    countEvent(&shard->stats.lookups, 1);
+    countEvent(&shard->stats.probes, probes);
+    if (node != NULL)
+    {
+        touchNode(shard, node);
+    }
+    return node;
+}
+
+void applyRead(LruShard *shard, QueueNode *node)
+{
+    if (node->resident)
+    {
+        if (shard->policy == EVICTION_WTINYLFU)
+        {
+            recordFrequency(&shard->sketch, node->hash);
+        }
+        touchNode(shard, node);
+    }
+}
+
+void drainReadBuffers(LruShard *shard)
+{
+    if (shard->readBuffers == NULL)
+    {
+        return;
+    }
+    for (int stripe = 0; stripe < READ_BUFFER_STRIPES; stripe++)
+    {
+        ReadBuffer *buffer = &shard->readBuffers[stripe];
+        unsigned int head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+        for (; head != tail; head++)
+        {
+            QueueNode *node = atomic_exchange_explicit(&buffer->entries[head % READ_BUFFER_SIZE], NULL, memory_order_acquire);
+            if (node != NULL)
+            {
+                applyRead(shard, node);
+            }
+        }
+        atomic_store_explicit(&buffer->head, head, memory_order_release);
+    }
+}
+
+/* A full stripe is drained on the spot when the lock is free; otherwise the hit is dropped. */
+void recordRead(LruShard *shard, QueueNode *node, int slot)
+{
+    ReadBuffer *buffer = &shard->readBuffers[slot % READ_BUFFER_STRIPES];
+    unsigned int tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    if (tail - head < READ_BUFFER_SIZE && atomic_compare_exchange_weak_explicit(&buffer->tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed))
+    {
+        atomic_store_explicit(&buffer->entries[tail % READ_BUFFER_SIZE], node, memory_order_release);
+        return;
+    }
+    if (pthread_mutex_trylock(&shard->lock) == 0)
+    {
+        drainReadBuffers(shard);
+        applyRead(shard, node);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Lock holders replay buffered reads first and reclaim retired nodes on the way out. */
+void lockShard(LruShard *shard)
+{
+    pthread_mutex_lock(&shard->lock);
+    drainReadBuffers(shard);
+}
+
+void unlockShard(LruShard *shard)
+{
+    if (shard->epochs != NULL && shard->retired.count >= RETIRE_BATCH_SIZE)
+    {
+        reclaimRetired(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+bool lockFreeGetValue(LruShard *shard, EpochState *epochs, int slot, const CacheKey *key, unsigned int hash, void *buffer, size_t bufferSize, size_t *valueLength)
+{
+    size_t probes;
+    enterEpoch(epochs, slot);
+    QueueNode *node = findInIndexLockFree(&shard->index, &shard->nodes, key, hash, &probes);
+    long long expiresAt = node != NULL ? __atomic_load_n(&node->expiresAt, __ATOMIC_RELAXED) : 0;
+    if (expiresAt != 0 && expiresAt <= monotonicMillis())
+    {
+        node = NULL;
+    }
+    if (node != NULL)
+    {
+        const ValueBlock *block = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+        size_t length = block->length;
+        memcpy(buffer, block->data + block->keyLength, length < bufferSize ? length : bufferSize);
+        if (valueLength != NULL)
+        {
+            *valueLength = length;
+        }
+    }
+    exitEpoch(epochs, slot);
+
+    countEvent(&shard->stats.lookups, 1);
+    countEvent(&shard->stats.probes, probes);
+    countEvent(node != NULL ? &shard->stats.hits : &shard->stats.misses, 1);
+    if (node != NULL)
+    {
+        recordRead(shard, node, slot);
+    }
+    return node != NULL;
+}
+
+QueueNode *lookupForGet(LruShard *shard, const CacheKey *key, unsigned int hash)
+{
+    QueueNode *node = touchKey(shard, key, hash);
+    countEvent(node != NULL ? &shard->stats.hits : &shard->stats.misses, 1);
+    return node;
+}
+
+/* Single-threaded callers only: any later get or put, from any thread, may expire or evict the entry and free the returned value. Threads sharing a cache use cacheGetValue(). */
+char *cacheGetBytes(LruCache *cache, CacheKey key, size_t *valueLength)
+{
+    long long startNanos = cache->recordLatency ? monotonicNanos() : 0;
+    unsigned long long hash = hashCacheKey(&key);
+    LruShard *shard = shardForHash(cache, hash);
+
+    lockShard(shard);
+    expireDueEntries(shard, false);
+    QueueNode *node = lookupForGet(shard, &key, (unsigned int)hash);
+    unlockShard(shard);
+
+    recordLatency(&shard->stats.getLatency, startNanos);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    *valueLength = node->value->length;
+    return nodeValue(node);
+}
+
+/* Single-threaded like cacheGetBytes(). */
+char *cacheGet(LruCache *cache, CacheKey key)
+{
+    size_t valueLength;
+    return cacheGetBytes(cache, key, &valueLength);
+}
+
+/* With lockFreeReads this never takes the shard lock unless the thread's read buffer needs draining. */
+bool cacheGetValue(LruCache *cache, CacheKey key, void *buffer, size_t bufferSize, size_t *valueLength)
+{
+    long long startNanos = cache->recordLatency ? monotonicNanos() : 0;
+    unsigned long long hash = hashCacheKey(&key);
+    LruShard *shard = shardForHash(cache, hash);
+
+    int slot = cache->epochs != NULL ? currentReaderSlot() : -1;
+    if (slot >= 0)
+    {
+        bool found = lockFreeGetValue(shard, cache->epochs, slot, &key, (unsigned int)hash, buffer, bufferSize, valueLength);
+        recordLatency(&shard->stats.getLatency, startNanos);
+        return found;
+    }
+
+    lockShard(shard);
+    expireDueEntries(shard, false);
+    QueueNode *node = lookupForGet(shard, &key, (unsigned int)hash);
+    if (node != NULL)
+    {
+        size_t length = node->value->length;
+        memcpy(buffer, nodeValue(node), length < bufferSize ? length : bufferSize);
+        if (valueLength != NULL)
+        {
+            *valueLength = length;
+        }
+    }
+    unlockShard(shard);
+
+    recordLatency(&shard->stats.getLatency, startNanos);
+    return node != NULL;
+}
+
+ValueBlock *createValueBlock(LruShard *shard, const CacheKey *key, const void *value, size_t length)
+{
+    size_t keyLength = key->type == KEY_STRING ? key->length : 0;
+    ValueBlock *block = allocateValueBlock(&shard->arena, keyLength + length);
+    block->keyLength = (unsigned int)keyLength;
+    if (keyLength > 0)
+    {
+        memcpy(block->data, key->bytes, keyLength);
+    }
+    block->length = (unsigned int)length;
+    memcpy(block->data + keyLength, value, length);
+    block->data[keyLength + length] = '\0';
+    return block;
+}
+
+void storeEntry(LruShard *shard, QueueNode *node, const CacheKey *key, const void *value, size_t length)
+{
+    if (node->value == NULL)
+    {
+        node->value = createValueBlock(shard, key, value, length);
+    }
+    else if (shard->epochs != NULL)
+    {
+        /* Lock-free readers may be copying the old block, so it is replaced and retired rather than overwritten. */
+        ValueBlock *oldValue = node->value;
+        __atomic_store_n(&node->value, createValueBlock(shard, key, value, length), __ATOMIC_RELEASE);
+        retireObject(shard, oldValue, RETIRED_VALUE);
+    }
+    else
+    {
+        node->value->length = (unsigned int)length;
+        memcpy(nodeValue(node), value, length);
+        nodeValue(node)[length] = '\0';
+    }
+}
+
+bool fitsInShard(const LruShard *shard, const CacheKey *key, size_t length)
+{
+    size_t keyLength = key->type == KEY_STRING ? key->length : 0;
+    return entryCharge(shard, keyLength + length) <= shard->maxWeight && keyLength + length <= 0xffffffffU - sizeof(ValueBlock) - 1;
+}
+
+void initEntry(LruShard *shard, QueueNode *node, const CacheKey *key, unsigned int hash, const void *value, size_t length, long long ttlMillis)
+{
+    node->hash = hash;
+    node->keyType = (unsigned char)key->type;
+    node->intKey = key->intValue;
+    node->referenced = false;
+    node->resident = true;
+    node->expiresAt = 0;
+    node->value = NULL;
+    storeEntry(shard, node, key, value, length);
+    setEntryExpiry(shard, node, ttlMillis);
+    IndexSlot *oldSlots = insertIntoIndex(&shard->index, node);
+    if (oldSlots != NULL && shard->epochs != NULL)
+    {
+        retireObject(shard, oldSlots, RETIRED_TABLE);
+    }
+    else
+    {
+        free(oldSlots);
+    }
+
+    shard->count++;
+    shard->weight += node->charge;
+}
+
+/* Eviction victim for making room around an entry that must stay, skipping it wherever it sits. */
+QueueNode *victimBesides(LruShard *shard, const QueueNode *keep)
+{
+    if (shard->policy == EVICTION_CLOCK)
+    {
+        QueueNode *victim = sweepClock(shard);
+        return victim != keep ? victim : sweepClock(shard);
+    }
+    static const Segment evictOrder[SEGMENT_COUNT] = {SEGMENT_PROBATION, SEGMENT_PROTECTED, SEGMENT_RECENCY};
+    for (int i = 0; i < SEGMENT_COUNT; i++)
+    {
+        QueueNode *victim = shard->lists[evictOrder[i]].tail;
+        if (victim == keep)
+        {
+            victim = nodeAt(&shard->nodes, victim->prev);
+        }
+        if (victim != NULL)
+        {
+            return victim;
+        }
+    }
+    return NULL;
+}
+
+/* A value that changes size class gets a new block, but the entry keeps its node, segment and recency position. */
+void resizeEntry(LruShard *shard, QueueNode *node, const CacheKey *key, const void *value, size_t length)
+{
+    size_t keyLength = key->type == KEY_STRING ? key->length : 0;
+    ValueBlock *oldValue = node->value;
+    __atomic_store_n(&node->value, createValueBlock(shard, key, value, length), __ATOMIC_RELEASE);
+    if (shard->epochs != NULL)
+    {
+        retireObject(shard, oldValue, RETIRED_VALUE);
+    }
+    else
+    {
+        freeValueBlock(&shard->arena, oldValue);
+    }
+
+    size_t charge = entryCharge(shard, keyLength + length);
+    shard->lists[node->segment].weight += charge - node->charge;
+    shard->weight += charge - node->charge;
+    node->charge = charge;
+    while (shard->count > 1 && shard->weight > shard->maxWeight)
+    {
+        evictNode(shard, victimBesides(shard, node));
+        countEvent(&shard->stats.evictions, 1);
+    }
+}
+
+void putLocked(LruShard *shard, const CacheKey *key, unsigned int hash, const void *value, size_t length, long long ttlMillis)
+{
+    size_t keyLength = key->type == KEY_STRING ? key->length : 0;
+    QueueNode *node = touchKey(shard, key, hash);
+    if (node != NULL)
+    {
+        if (node->value->sizeClass != LARGE_VALUE_CLASS && valueBlockSize(keyLength + length) == valueBlockSize(keyLength + node->value->length))
+        {
+            storeEntry(shard, node, key, value, length);
+        }
+        else
+        {
+            resizeEntry(shard, node, key, value, length);
+        }
+        setEntryExpiry(shard, node, ttlMillis);
+        countEvent(&shard->stats.updates, 1);
+        return;
+    }
+
+    countEvent(&shard->stats.inserts, 1);
+    size_t charge = entryCharge(shard, keyLength + length);
+    initEntry(shard, allocateNode(shard, charge), key, hash, value, length, ttlMillis);
+}
+
+bool cachePutValueWithTtl(LruCache *cache, CacheKey key, const void *value, size_t length, long long ttlMillis)
+{
+    long long startNanos = cache->recordLatency ? monotonicNanos() : 0;
+    unsigned long long hash = hashCacheKey(&key);
+    LruShard *shard = shardForHash(cache, hash);
+    if (!fitsInShard(shard, &key, length))
+    {
+        return false;
+    }
+
+    lockShard(shard);
+    expireDueEntries(shard, ttlMillis > 0);
+    putLocked(shard, &key, (unsigned int)hash, value, length, ttlMillis);
+    unlockShard(shard);
+
+    recordLatency(&shard->stats.putLatency, startNanos);
+    return true;
+}
+
+bool cachePutValue(LruCache *cache, CacheKey key, const void *value, size_t length)
+{
+    return cachePutValueWithTtl(cache, key, value, length, 0);
+}
+
+void planBatch(LruCache *cache, BatchPlan *plan, const CacheKey *firstKey, size_t keyStride, size_t count)
+{
+    int shardOf[BATCH_CHUNK_SIZE];
+    bool placed[BATCH_CHUNK_SIZE] = {false};
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const CacheKey *key = (const CacheKey *)((const char *)firstKey + i * keyStride);
+        plan->hashes[i] = hashCacheKey(key);
+        shardOf[i] = (int)(shardForHash(cache, plan->hashes[i]) - cache->shards);
+    }
+
+    int position = 0;
+    plan->groupCount = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (placed[i])
+        {
+            continue;
+        }
+        plan->groupShards[plan->groupCount] = shardOf[i];
+        plan->groupStarts[plan->groupCount++] = position;
+        for (size_t j = i; j < count; j++)
+        {
+            if (!placed[j] && shardOf[j] == shardOf[i])
+            {
+                placed[j] = true;
+                plan->order[position++] = (int)j;
+            }
+        }
+    }
+    plan->groupStarts[plan->groupCount] = position;
+}
+
+void prefetchBatchGroup(const LruShard *shard, const BatchPlan *plan, int group)
+{
+    const HashIndex *index = &shard->index;
+    for (int i = plan->groupStarts[group]; i < plan->groupStarts[group + 1]; i++)
+    {
+        __builtin_prefetch(&index->slots[(unsigned int)plan->hashes[plan->order[i]] & index->mask]);
+    }
+    for (int i = plan->groupStarts[group]; i < plan->groupStarts[group + 1]; i++)
+    {
+        const QueueNode *node = nodeAt(&shard->nodes, index->slots[(unsigned int)plan->hashes[plan->order[i]] & index->mask].nodeId);
+        if (node != NULL)
+        {
+            __builtin_prefetch(node);
+        }
+    }
+}
+
+size_t mget(LruCache *cache, BatchGet *requests, size_t count)
+{
+    BatchPlan plan;
+    size_t hits = 0;
+
+    for (size_t base = 0; base < count; base += BATCH_CHUNK_SIZE)
+    {
+        size_t chunk = count - base < BATCH_CHUNK_SIZE ? count - base : BATCH_CHUNK_SIZE;
+        BatchGet *batch = requests + base;
+        planBatch(cache, &plan, &batch[0].key, sizeof(BatchGet), chunk);
+
+        for (int group = 0; group < plan.groupCount; group++)
+        {
+            LruShard *shard = &cache->shards[plan.groupShards[group]];
+            lockShard(shard);
+            expireDueEntries(shard, false);
+            prefetchBatchGroup(shard, &plan, group);
+            for (int i = plan.groupStarts[group]; i < plan.groupStarts[group + 1]; i++)
+            {
+                BatchGet *request = &batch[plan.order[i]];
+                QueueNode *node = lookupForGet(shard, &request->key, (unsigned int)plan.hashes[plan.order[i]]);
+                request->found = node != NULL;
+                if (node != NULL)
+                {
+                    request->valueLength = node->value->length;
+                    memcpy(request->buffer, nodeValue(node), request->valueLength < request->bufferSize ? request->valueLength : request->bufferSize);
+                    hits++;
+                }
+            }
+            unlockShard(shard);
+        }
+    }
+    return hits;
+}
+
+size_t mput(LruCache *cache, BatchPut *requests, size_t count)
+{
+    BatchPlan plan;
+    size_t stored = 0;
+
+    for (size_t base = 0; base < count; base += BATCH_CHUNK_SIZE)
+    {
+        size_t chunk = count - base < BATCH_CHUNK_SIZE ? count - base : BATCH_CHUNK_SIZE;
+        BatchPut *batch = requests + base;
+        planBatch(cache, &plan, &batch[0].key, sizeof(BatchPut), chunk);
+
+        for (int group = 0; group < plan.groupCount; group++)
+        {
+            LruShard *shard = &cache->shards[plan.groupShards[group]];
+            lockShard(shard);
+            expireDueEntries(shard, true);
+            prefetchBatchGroup(shard, &plan, group);
+            for (int i = plan.groupStarts[group]; i < plan.groupStarts[group + 1]; i++)
+            {
+                BatchPut *request = &batch[plan.order[i]];
+                request->stored = fitsInShard(shard, &request->key, request->length);
+                if (request->stored)
+                {
+                    putLocked(shard, &request->key, (unsigned int)plan.hashes[plan.order[i]], request->value, request->length, request->ttlMillis);
+                    stored++;
+                }
+            }
+            unlockShard(shard);
+        }
+    }
+    return stored;
+}
+
+long long wallClockMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool writeShardSnapshot(FILE *file, LruShard *shard, long long wallOffset, uint64_t *entryCount)
+{
+    static const Segment saveOrder[SEGMENT_COUNT] = {SEGMENT_PROTECTED, SEGMENT_PROBATION, SEGMENT_RECENCY};
+    for (int i = 0; i < SEGMENT_COUNT; i++)
+    {
+        for (QueueNode *node = shard->lists[saveOrder[i]].head; node != NULL; node = nodeAt(&shard->nodes, node->next))
+        {
+            SnapshotRecord record = {0};
+            record.keyLength = node->value->keyLength;
+            record.valueLength = node->value->length;
+            record.keyType = node->keyType;
+            record.segment = node->segment;
+            record.intKey = node->intKey;
+            record.expiresAtWallMillis = node->expiresAt != 0 ? node->expiresAt + wallOffset : 0;
+            if (fwrite(&record, sizeof(record), 1, file) != 1 || fwrite(node->value->data, 1, record.keyLength + record.valueLength, file) != record.keyLength + record.valueLength)
+            {
+                return false;
+            }
+            (*entryCount)++;
+        }
+    }
+    return true;
+}
+
+/* The snapshot is written beside the target and renamed over it once it is on disk, so a failed save never leaves a torn file at path. */
+long long saveCache(LruCache *cache, const char *path)
+{
+    size_t pathLength = strlen(path);
+    char *tempPath = (char *)malloc(pathLength + sizeof(".tmp"));
+    if (tempPath == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed while saving snapshot.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", sizeof(".tmp"));
+    FILE *file = fopen(tempPath, "wb");
+    if (file == NULL)
+    {
+        free(tempPath);
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+
+    SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < cache->shardCount && ok; i++)
+    {
+        LruShard *shard = &cache->shards[i];
+        lockShard(shard);
+        expireDueEntries(shard, false);
+        ok = writeShardSnapshot(file, shard, wallClockMillis() - monotonicMillis(), &header.entryCount);
+        unlockShard(shard);
+    }
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tempPath, path) == 0;
+    if (!ok)
+    {
+        unlink(tempPath);
+    }
+    free(tempPath);
+    return ok ? (long long)header.entryCount : -1;
+}
+
+QueueNode *restoreVictim(LruShard *shard)
+{
+    if (shard->policy == EVICTION_CLOCK)
+    {
+        return sweepClock(shard);
+    }
+    for (int segment = SEGMENT_PROBATION; segment < SEGMENT_COUNT; segment++)
+    {
+        if (shard->lists[segment].tail != NULL)
+        {
+            return shard->lists[segment].tail;
+        }
+    }
+    return shard->lists[SEGMENT_RECENCY].tail;
+}
+
+/* Snapshots are replayed from tail to head, so each restored entry goes to the head of its saved segment. Returns false for a key already present. */
+bool restoreLocked(LruShard *shard, const CacheKey *key, unsigned int hash, const void *value, size_t length, long long ttlMillis, Segment segment)
+{
+    size_t probes;
+    if (findInIndex(&shard->index, &shard->nodes, key, hash, &probes) != NULL)
+    {
+        return false;
+    }
+
+    size_t charge = entryCharge(shard, (key->type == KEY_STRING ? key->length : 0) + length);
+    while (needsRoom(shard, charge))
+    {
+        evictNode(shard, restoreVictim(shard));
+        countEvent(&shard->stats.evictions, 1);
+    }
+    if (shard->policy != EVICTION_WTINYLFU)
+    {
+        segment = SEGMENT_RECENCY;
+    }
+
+    QueueNode *node = popFreeNode(shard);
+    node->charge = charge;
+    node->segment = (unsigned char)segment;
+    insertAtHead(&shard->lists[segment], node);
+    if (shard->policy == EVICTION_CLOCK && shard->hand == NULL)
+    {
+        shard->hand = node;
+    }
+    initEntry(shard, node, key, hash, value, length, ttlMillis);
+
+    if (shard->policy == EVICTION_WTINYLFU)
+    {
+        recordFrequency(&shard->sketch, hash);
+        if (segment == SEGMENT_PROTECTED)
+        {
+            promoteToProtected(shard, node);
+        }
+    }
+    return true;
+}
+
+long long loadCache(LruCache *cache, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t fileSize = (size_t)fileStat.st_size;
+    const char *data = (const char *)mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise((void *)data, fileSize, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t *offsets = NULL;
+    bool ok = header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION && header.entryCount <= fileSize / sizeof(SnapshotRecord);
+    if (ok)
+    {
+        offsets = (size_t *)malloc((header.entryCount + 1) * sizeof(size_t));
+        if (offsets == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed while loading snapshot.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t offset = sizeof(SnapshotHeader);
+    for (uint64_t i = 0; ok && i < header.entryCount; i++)
+    {
+        SnapshotRecord record;
+        if (fileSize - offset < sizeof(record))
+        {
+            ok = false;
+            break;
+        }
+        memcpy(&record, data + offset, sizeof(record));
+        offsets[i] = offset;
+        offset += sizeof(record);
+        ok = record.keyType <= KEY_STRING && record.segment < SEGMENT_COUNT && (uint64_t)record.keyLength + record.valueLength <= fileSize - offset;
+        offset += (size_t)record.keyLength + record.valueLength;
+    }
+    if (!ok)
+    {
+        free(offsets);
+        munmap((void *)data, fileSize);
+        return -1;
+    }
+
+    for (int i = 0; i < cache->shardCount; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        expireDueEntries(&cache->shards[i], true);
+    }
+
+    long long wallNow = wallClockMillis();
+    long long restored = 0;
+    for (uint64_t i = header.entryCount; i > 0; i--)
+    {
+        SnapshotRecord record;
+        memcpy(&record, data + offsets[i - 1], sizeof(record));
+        const char *keyBytes = data + offsets[i - 1] + sizeof(record);
+        long long ttlMillis = record.expiresAtWallMillis != 0 ? record.expiresAtWallMillis - wallNow : 0;
+        if (record.expiresAtWallMillis != 0 && ttlMillis <= 0)
+        {
+            continue;
+        }
+
+        CacheKey key = {(KeyType)record.keyType, record.intKey, keyBytes, record.keyType == KEY_STRING ? record.keyLength : 0};
+        unsigned long long hash = hashCacheKey(&key);
+        LruShard *shard = shardForHash(cache, hash);
+        if (fitsInShard(shard, &key, record.valueLength) && restoreLocked(shard, &key, (unsigned int)hash, keyBytes + record.keyLength, record.valueLength, ttlMillis, (Segment)record.segment))
+        {
+            restored++;
+        }
+    }
+
+    for (int i = cache->shardCount - 1; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    free(offsets);
+    munmap((void *)data, fileSize);
+    return restored;
+}
+
+void getCacheStats(LruCache *cache, CacheStats *stats)
+{
+    unsigned long long lookups = 0;
+    unsigned long long probes = 0;
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < cache->shardCount; i++)
+    {
+        ShardStats *shardStats = &cache->shards[i].stats;
+        stats->hits += atomic_load_explicit(&shardStats->hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&shardStats->misses, memory_order_relaxed);
+        stats->inserts += atomic_load_explicit(&shardStats->inserts, memory_order_relaxed);
+        stats->updates += atomic_load_explicit(&shardStats->updates, memory_order_relaxed);
+        stats->evictions += atomic_load_explicit(&shardStats->evictions, memory_order_relaxed);
+        stats->expirations += atomic_load_explicit(&shardStats->expirations, memory_order_relaxed);
+        lookups += atomic_load_explicit(&shardStats->lookups, memory_order_relaxed);
+        probes += atomic_load_explicit(&shardStats->probes, memory_order_relaxed);
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        {
+            stats->getLatency[bucket] += atomic_load_explicit(&shardStats->getLatency.counts[bucket], memory_order_relaxed);
+            stats->putLatency[bucket] += atomic_load_explicit(&shardStats->putLatency.counts[bucket], memory_order_relaxed);
+        }
+
+        pthread_mutex_lock(&cache->shards[i].lock);
+        stats->entries += (unsigned long long)cache->shards[i].count;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    stats->averageProbeLength = lookups > 0 ? (double)probes / (double)lookups : 0.0;
+}
+
+unsigned long long latencyPercentile(const unsigned long long *histogram, double percentile)
+{
+    unsigned long long total = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        total += histogram[bucket];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * (double)total);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        seen += histogram[bucket];
+        if (seen > rank)
+        {
+            return latencyBucketValue(bucket);
+        }
+    }
+    return latencyBucketValue(LATENCY_BUCKETS - 1);
+}
+
+void printLatencyLine(const char *label, const unsigned long long *histogram)
+{
+    printf("%s latency ns: p50=%llu p99=%llu p999=%llu max=%llu\n", label, latencyPercentile(histogram, 50.0), latencyPercentile(histogram, 99.0), latencyPercentile(histogram, 99.9), latencyPercentile(histogram, 100.0));
+}
 
-#define HASH_TABLE_SIZE 2048
-#define MAX_VALUE_LENGTH 64
+void printCacheStats(LruCache *cache)
+{
+    CacheStats stats;
+    getCacheStats(cache, &stats);
+    unsigned long long gets = stats.hits + stats.misses;
 
-typedef struct QueueNode
+    printf("Entries:     %llu\n", stats.entries);
+    printf("Hits:        %llu\n", stats.hits);
+    printf("Misses:      %llu\n", stats.misses);
+    printf("Hit ratio:   %.2f%%\n", gets > 0 ? (double)stats.hits * 100.0 / (double)gets : 0.0);
+    printf("Inserts:     %llu\n", stats.inserts);
+    printf("Updates:     %llu\n", stats.updates);
+    printf("Evictions:   %llu\n", stats.evictions);
+    printf("Expirations: %llu\n", stats.expirations);
+    printf("Avg probes:  %.2f\n", stats.averageProbeLength);
+    if (cache->recordLatency)
+    {
+        printLatencyLine("get", stats.getLatency);
+        printLatencyLine("put", stats.putLatency);
+    }
+}
+
+/* Single-threaded like cacheGetBytes(); threads sharing a cache use getCopy() or getValue(). */
+char *get(LruCache *cache, int key)
 {
-    int key;
-    char value[MAX_VALUE_LENGTH];
-    struct QueueNode *prev;
-    struct QueueNode *next;
-    struct QueueNode *hashNext;
-} QueueNode;
+    return cacheGet(cache, int64Key(key));
+}
 
-typedef struct LruCache
+bool getValue(LruCache *cache, int key, void *buffer, size_t bufferSize, size_t *valueLength)
 {
-    int capacity;
-    int count;
-    QueueNode *head;
-    QueueNode *tail;
-    QueueNode *hashTable[HASH_TABLE_SIZE];
-} LruCache;
+    return cacheGetValue(cache, int64Key(key), buffer, bufferSize, valueLength);
+}
+
+bool getCopy(LruCache *cache, int key, char *buffer, size_t bufferSize)
+{
+    size_t length = 0;
+    if (bufferSize == 0 || !getValue(cache, key, buffer, bufferSize - 1, &length))
+    {
+        return false;
+    }
+    buffer[length < bufferSize - 1 ? length : bufferSize - 1] = '\0';
+    return true;
+}
+
+bool putValue(LruCache *cache, int key, const void *value, size_t length)
+{
+    return cachePutValue(cache, int64Key(key), value, length);
+}
 
-unsigned int getHashIndex(int key)
+bool put(LruCache *cache, int key, const char *value)
 {
-    return key % HASH_TABLE_SIZE;
+    return putValue(cache, key, value, strlen(value));
 }
 
-void detachNode(LruCache *cache, QueueNode *node)
+unsigned long long nextRandom(unsigned long long *state)
 {
-    if (node->prev != NULL)
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* ln x for x >= 1: halve into [1, 2), then ln x = 2 atanh(y) with y = (x - 1) / (x + 1) <= 1/3. */
+double naturalLog(double x)
+{
+    double halvings = 0.0;
+    while (x >= 2.0)
     {
-        node->prev->next = node->next;
+        x /= 2.0;
+        halvings += 1.0;
     }
-    else
+    double y = (x - 1.0) / (x + 1.0);
+    double term = y;
+    double sum = 0.0;
+    for (int k = 1; k < 40; k += 2)
     {
-        cache->head = node->next;
+        sum += term / k;
+        term *= y * y;
     }
+    return halvings * LN2 + 2.0 * sum;
+}
 
-    if (node->next != NULL)
+/* e^x for x <= 0: e^x = 2^-n e^r with r in (-ln 2, 0], so the Taylor series converges quickly. */
+double naturalExp(double x)
+{
+    if (x < -745.0)
     {
-        node->next->prev = node->prev;
+        return 0.0;
     }
-    else
+    int halvings = (int)(-x / LN2);
+    x += halvings * LN2;
+    double term = 1.0;
+    double sum = 1.0;
+    for (int k = 1; k < 25; k++)
+    {
+        term *= x / k;
+        sum += term;
+    }
+    for (double factor = 0.5; halvings > 0; halvings >>= 1, factor *= factor)
     {
-        cache->tail = node->prev;
+        if (halvings & 1)
+        {
+            sum *= factor;
+        }
     }
+    return sum;
 }
 
-void insertAtHead(LruCache *cache, QueueNode *node)
+/* Weights are rank^-skew, built from naturalLog/naturalExp so the file links without libm. */
+double *buildZipfTable(int keySpace, double skew)
 {
-    node->next = cache->head;
-    node->prev = NULL;
-
-    if (cache->head != NULL)
+    double *cumulative = (double *)malloc((size_t)keySpace * sizeof(double));
+    if (cumulative == NULL)
     {
-        cache->head->prev = node;
+        fprintf(stderr, "Error: Memory allocation failed for Zipf table.\n");
+        exit(EXIT_FAILURE);
     }
-
-    cache->head = node;
-
-    if (cache->tail == NULL)
+    double total = 0.0;
+    for (int rank = 0; rank < keySpace; rank++)
+    {
+        total += naturalExp(-skew * naturalLog((double)(rank + 1)));
+        cumulative[rank] = total;
+    }
+    for (int rank = 0; rank < keySpace; rank++)
     {
-        cache->tail = node;
+        cumulative[rank] /= total;
     }
+    return cumulative;
 }
 
-void removeFromHashTable(LruCache *cache, QueueNode *targetNode)
+int sampleZipf(const double *cumulative, int keySpace, unsigned long long *state)
 {
-    unsigned int hashIndex = getHashIndex(targetNode->key);
-    QueueNode *current = cache->hashTable[hashIndex];
-    QueueNode *prev = NULL;
+    double target = (double)(nextRandom(state) >> 11) / 9007199254740992.0;
+    int low = 0;
+    int high = keySpace - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (cumulative[middle] < target)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
 
-    while (current != NULL)
+int *loadTraceFile(const char *path, size_t *count)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    size_t capacity = 1024;
+    int *keys = (int *)malloc(capacity * sizeof(int));
+    if (keys == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for trace.\n");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    int key;
+    while (fscanf(file, "%d", &key) == 1)
     {
-        if (current == targetNode)
+        if (*count == capacity)
         {
-            if (prev == NULL)
+            capacity *= 2;
+            keys = (int *)realloc(keys, capacity * sizeof(int));
+            if (keys == NULL)
             {
-                cache->hashTable[hashIndex] = current->hashNext;
+                fprintf(stderr, "Error: Memory allocation failed for trace.\n");
+                exit(EXIT_FAILURE);
             }
-            else
+        }
+        keys[(*count)++] = key;
+    }
+    fclose(file);
+    return keys;
+}
+
+/* Synthetic traces are generated up front so the timed loop only touches the cache. */
+int *generateTrace(const BenchOptions *options, size_t *count)
+{
+    if (options->trace == TRACE_FILE)
+    {
+        return loadTraceFile(options->tracePath, count);
+    }
+
+    *count = (size_t)options->operations;
+    int *keys = (int *)malloc(*count * sizeof(int));
+    if (keys == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for trace.\n");
+        exit(EXIT_FAILURE);
+    }
+    double *cumulative = options->trace == TRACE_UNIFORM ? NULL : buildZipfTable(options->keySpace, options->skew);
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    size_t i = 0;
+
+    while (i < *count)
+    {
+        if (options->trace == TRACE_UNIFORM)
+        {
+            keys[i++] = (int)(nextRandom(&state) % (unsigned long long)options->keySpace);
+        }
+        else if (options->trace == TRACE_SCAN && nextRandom(&state) % (100ULL * (unsigned long long)options->scanLength) < (unsigned long long)options->scanPercent)
+        {
+            /* Scans walk keys outside the Zipf key space, so each one is touched once and never again soon. */
+            long long start = options->keySpace + (long long)(nextRandom(&state) % (unsigned long long)options->keySpace);
+            for (int step = 0; step < options->scanLength && i < *count; step++)
             {
-                prev->hashNext = current->hashNext;
+                keys[i++] = (int)(start + step);
             }
-            return;
         }
-        prev = current;
-        current = current->hashNext;
+        else
+        {
+            keys[i++] = sampleZipf(cumulative, options->keySpace, &state);
+        }
+    }
+    free(cumulative);
+    return keys;
+}
+
+/* Cache-aside replay: every miss is followed by a put of the missing key. Workers share the cache, so reads copy out through getCopy(). */
+void *runBenchWorker(void *argument)
+{
+    BenchWorker *worker = (BenchWorker *)argument;
+    char buffer[BENCH_VALUE_LENGTH];
+    char value[BENCH_VALUE_LENGTH];
+
+    for (size_t i = 0; i < worker->count; i++)
+    {
+        int key = worker->keys[i];
+        if (!getCopy(worker->cache, key, buffer, sizeof(buffer)))
+        {
+            snprintf(value, sizeof(value), "value-%d", key);
+            put(worker->cache, key, value);
+        }
     }
+    return NULL;
 }
 
-void removeLruNode(LruCache *cache)
+void runBenchmarkCase(const BenchOptions *options, const int *keys, size_t count, int capacity, int threads)
 {
-    if (cache->tail == NULL)
+    /* The shard count is fixed across runs so rows for different thread counts measure the same cache. */
+    CacheConfig config = {capacity, 0, options->shardCount <= capacity ? options->shardCount : 1, options->policy, true, options->lockFreeReads};
+    LruCache *cache = createCacheWithConfig(&config);
+    if (cache == NULL)
     {
+        printf("%9d %7d  invalid configuration\n", capacity, threads);
         return;
     }
-    QueueNode *lruNode = cache->tail;
-    detachNode(cache, lruNode);
-    removeFromHashTable(cache, lruNode);
-    free(lruNode);
-    cache->count--;
+    pthread_t *handles = (pthread_t *)malloc((size_t)threads * sizeof(pthread_t));
+    BenchWorker *workers = (BenchWorker *)malloc((size_t)threads * sizeof(BenchWorker));
+    if (handles == NULL || workers == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for benchmark threads.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long long startNanos = monotonicNanos();
+    for (int i = 0; i < threads; i++)
+    {
+        size_t begin = count * (size_t)i / (size_t)threads;
+        size_t end = count * (size_t)(i + 1) / (size_t)threads;
+        workers[i].cache = cache;
+        workers[i].keys = keys + begin;
+        workers[i].count = end - begin;
+        if (pthread_create(&handles[i], NULL, runBenchWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Error: Could not start benchmark thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(handles[i], NULL);
+    }
+    double seconds = (double)(monotonicNanos() - startNanos) / 1e9;
+
+    CacheStats stats;
+    getCacheStats(cache, &stats);
+    unsigned long long latency[LATENCY_BUCKETS];
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        latency[bucket] = stats.getLatency[bucket] + stats.putLatency[bucket];
+    }
+    unsigned long long gets = stats.hits + stats.misses;
+
+    printf("%9d %7d %12.0f %8.2f%% %8llu %8llu %8llu\n", capacity, threads, seconds > 0.0 ? (double)count / seconds : 0.0, gets > 0 ? (double)stats.hits * 100.0 / (double)gets : 0.0, latencyPercentile(latency, 50.0), latencyPercentile(latency, 99.0), latencyPercentile(latency, 99.9));
+
+    free(workers);
+    free(handles);
+    freeCache(cache);
 }
 
-void freeCache(LruCache *cache)
+int parseIntList(const char *text, int *values)
 {
-    QueueNode *current = cache->head;
-    while (current != NULL)
+    int count = 0;
+    char *end;
+    while (count < BENCH_MAX_RUNS)
     {
-        QueueNode *next = current->next;
-        free(current);
-        current = next;
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0)
+        {
+            return 0;
+        }
+        values[count++] = (int)value;
+        if (*end != ',')
+        {
+            break;
+        }
+        text = end + 1;
     }
-    free(cache);
+    return *end == '\0' ? count : 0;
 }
 
-LruCache *createCache(int capacity)
+bool parseBenchOptions(int argc, char *argv[], BenchOptions *options)
 {
-    if (capacity <= 0)
+    *options = (BenchOptions){.trace = TRACE_ZIPF, .policy = EVICTION_LRU, .operations = 4000000, .keySpace = 1000000, .skew = 0.99, .scanPercent = 20, .scanLength = 1000, .threadCounts = {1, 2, 4, 8}, .threadRuns = 4, .capacities = {10000, 100000}, .capacityRuns = 2, .shardCount = 32};
+
+    for (int i = 0; i + 1 < argc; i += 2)
     {
-        return NULL;
+        const char *option = argv[i];
+        const char *argument = argv[i + 1];
+        if (strcmp(option, "--trace") == 0)
+        {
+            if (strcmp(argument, "uniform") == 0)
+                options->trace = TRACE_UNIFORM;
+            else if (strcmp(argument, "zipf") == 0)
+                options->trace = TRACE_ZIPF;
+            else if (strcmp(argument, "scan") == 0)
+                options->trace = TRACE_SCAN;
+            else
+                return false;
+        }
+        else if (strcmp(option, "--file") == 0)
+        {
+            options->trace = TRACE_FILE;
+            options->tracePath = argument;
+        }
+        else if (strcmp(option, "--policy") == 0)
+        {
+            if (strcmp(argument, "lru") == 0)
+                options->policy = EVICTION_LRU;
+            else if (strcmp(argument, "clock") == 0)
+                options->policy = EVICTION_CLOCK;
+            else if (strcmp(argument, "wtinylfu") == 0)
+                options->policy = EVICTION_WTINYLFU;
+            else
+                return false;
+        }
+        else if (strcmp(option, "--reads") == 0)
+        {
+            if (strcmp(argument, "locked") == 0)
+                options->lockFreeReads = false;
+            else if (strcmp(argument, "lockfree") == 0)
+                options->lockFreeReads = true;
+            else
+                return false;
+        }
+        else if (strcmp(option, "--ops") == 0)
+            options->operations = atoll(argument);
+        else if (strcmp(option, "--keys") == 0)
+            options->keySpace = atoi(argument);
+        else if (strcmp(option, "--skew") == 0)
+            options->skew = atof(argument);
+        else if (strcmp(option, "--scan-percent") == 0)
+            options->scanPercent = atoi(argument);
+        else if (strcmp(option, "--scan-length") == 0)
+            options->scanLength = atoi(argument);
+        else if (strcmp(option, "--threads") == 0)
+            options->threadRuns = parseIntList(argument, options->threadCounts);
+        else if (strcmp(option, "--capacities") == 0)
+            options->capacityRuns = parseIntList(argument, options->capacities);
+        else if (strcmp(option, "--shards") == 0)
+            options->shardCount = atoi(argument);
+        else
+            return false;
     }
-    LruCache *newCache = (LruCache *)malloc(sizeof(LruCache));
-    if (newCache == NULL)
+    return argc % 2 == 0 && options->operations > 0 && options->keySpace > 0 && options->keySpace <= INT32_MAX / 2 && options->skew >= 0.0 && options->scanLength > 0 && options->scanPercent >= 0 && options->scanPercent <= 100 && options->threadRuns > 0 && options->capacityRuns > 0 && options->shardCount > 0;
+}
+
+int runBenchmark(int argc, char *argv[])
+{
+    BenchOptions options;
+    if (!parseBenchOptions(argc, argv, &options))
     {
-        fprintf(stderr, "Error: Memory allocation failed for LruCache.\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Usage: bench [--trace uniform|zipf|scan] [--file trace.txt] [--policy lru|clock|wtinylfu] [--reads locked|lockfree] [--ops N] [--keys N] [--skew S] [--scan-percent P] [--scan-length N] [--threads 1,2,4] [--capacities 1000,10000] [--shards N]\n");
+        return EXIT_FAILURE;
     }
-    newCache->capacity = capacity;
-    newCache->count = 0;
-    newCache->head = NULL;
-    newCache->tail = NULL;
-    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    size_t count;
+    int *keys = generateTrace(&options, &count);
+    if (keys == NULL || count == 0)
     {
-        newCache->hashTable[i] = NULL;
+        fprintf(stderr, "Error: Could not read trace '%s'.\n", options.tracePath);
+        free(keys);
+        return EXIT_FAILURE;
     }
-    return newCache;
+
+    printf("%zu operations per run, %d shards\n", count, options.shardCount);
+    printf("%9s %7s %12s %9s %8s %8s %8s\n", "capacity", "threads", "ops/sec", "hit", "p50 ns", "p99 ns", "p999 ns");
+    for (int c = 0; c < options.capacityRuns; c++)
+    {
+        for (int t = 0; t < options.threadRuns; t++)
+        {
+            runBenchmarkCase(&options, keys, count, options.capacities[c], options.threadCounts[t]);
+        }
+    }
+    free(keys);
+    return EXIT_SUCCESS;
 }
 
-char *get(LruCache *cache, int key)
+CacheKey parseKey(const char *token)
 {
-    unsigned int hashIndex = getHashIndex(key);
-    QueueNode *node = cache->hashTable[hashIndex];
-    while (node != NULL)
+    char *end = NULL;
+    errno = 0;
+    long long value = strtoll(token, &end, 10);
+    if (end != token && *end == '\0' && errno == 0)
+    {
+        return int64Key(value);
+    }
+    return stringKey(token);
+}
+
+void flushOutput(OutputBuffer *output)
+{
+    fwrite(output->data, 1, output->used, stdout);
+    output->used = 0;
+}
+
+void writeOutput(OutputBuffer *output, const void *bytes, size_t length)
+{
+    if (output->used + length > COMMAND_OUTPUT_BUFFER)
     {
-        if (node->key == key)
+        flushOutput(output);
+        if (length > COMMAND_OUTPUT_BUFFER)
         {
-            detachNode(cache, node);
-            insertAtHead(cache, node);
-            return node->value;
+            fwrite(bytes, 1, length, stdout);
+            return;
         }
-        node = node->hashNext;
     }
-    return NULL;
+    memcpy(output->data + output->used, bytes, length);
+    output->used += length;
 }
 
-void put(LruCache *cache, int key, char *value)
+/* Regular files are mapped; pipes are read into one growing buffer. */
+char *mapCommandInput(int fd, size_t *size, bool *mapped)
 {
-    unsigned int hashIndex = getHashIndex(key);
-    QueueNode *node = cache->hashTable[hashIndex];
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0)
+    {
+        char *data = (char *)mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+            *size = (size_t)fileStat.st_size;
+            *mapped = true;
+            return data;
+        }
+    }
 
-    while (node != NULL)
+    size_t capacity = COMMAND_OUTPUT_BUFFER;
+    char *data = (char *)malloc(capacity);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for command input.\n");
+        exit(EXIT_FAILURE);
+    }
+    *size = 0;
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, data + *size, capacity - *size)) > 0)
     {
-        if (node->key == key)
+        *size += (size_t)bytesRead;
+        if (*size == capacity)
         {
-            strcpy(node->value, value);
-            detachNode(cache, node);
-            insertAtHead(cache, node);
-            return;
+            capacity *= 2;
+            data = (char *)realloc(data, capacity);
+            if (data == NULL)
+            {
+                fprintf(stderr, "Error: Memory allocation failed for command input.\n");
+                exit(EXIT_FAILURE);
+            }
         }
-        node = node->hashNext;
+    }
+    *mapped = false;
+    if (bytesRead < 0)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+void flushPendingPuts(LruCache *cache, BatchPut *pending, size_t *pendingCount)
+{
+    if (*pendingCount > 0)
+    {
+        mput(cache, pending, *pendingCount);
+        *pendingCount = 0;
+    }
+}
+
+/*
+ * Executes a binary command stream. Keys and values are used in place from the input and runs of puts
+ * go through mput(). Each get writes a uint32 length (COMMAND_MISS when absent) followed by the value.
+ */
+int runCommandStream(const char *path)
+{
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open command file '%s'.\n", path);
+        return EXIT_FAILURE;
+    }
+    size_t size;
+    bool mapped;
+    char *input = mapCommandInput(fd, &size, &mapped);
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    if (input == NULL)
+    {
+        fprintf(stderr, "Error: Could not read command file '%s'.\n", path);
+        return EXIT_FAILURE;
     }
 
-    QueueNode *newNode = (QueueNode *)malloc(sizeof(QueueNode));
-    if (newNode == NULL)
+    OutputBuffer output = {(char *)malloc(COMMAND_OUTPUT_BUFFER), 0};
+    if (output.data == NULL)
     {
-        fprintf(stderr, "Error: Memory allocation failed for QueueNode.\n");
+        fprintf(stderr, "Error: Memory allocation failed for command output.\n");
         exit(EXIT_FAILURE);
     }
-    newNode->key = key;
-    strcpy(newNode->value, value);
-    newNode->prev = NULL;
-    newNode->next = NULL;
-    newNode->hashNext = NULL;
+    BatchPut pending[BATCH_CHUNK_SIZE];
+    size_t pendingCount = 0;
+    LruCache *cache = NULL;
+    size_t offset = 0;
+    bool ok = true;
 
-    if (cache->count >= cache->capacity)
+    size_t commandStart = 0;
+    while (ok && offset < size)
     {
-        removeLruNode(cache);
+        CommandHeader header;
+        commandStart = offset;
+        long long ttlMillis = 0;
+        if (size - offset < sizeof(header))
+        {
+            ok = false;
+            break;
+        }
+        memcpy(&header, input + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.opcode == COMMAND_PUT_TTL)
+        {
+            if (size - offset < sizeof(int64_t))
+            {
+                ok = false;
+                break;
+            }
+            int64_t ttl;
+            memcpy(&ttl, input + offset, sizeof(ttl));
+            ttlMillis = ttl;
+            offset += sizeof(ttl);
+        }
+        size_t valueLength = header.opcode == COMMAND_PUT || header.opcode == COMMAND_PUT_TTL ? header.argument : 0;
+        if (size - offset < (size_t)header.keyLength + valueLength || header.keyType > KEY_STRING || (header.keyType == KEY_INT64 && header.opcode != COMMAND_CREATE && header.keyLength != sizeof(int64_t)))
+        {
+            ok = false;
+            break;
+        }
+        const char *keyBytes = input + offset;
+        const char *value = keyBytes + header.keyLength;
+        offset += (size_t)header.keyLength + valueLength;
+
+        CacheKey key = {(KeyType)header.keyType, 0, keyBytes, header.keyType == KEY_STRING ? header.keyLength : 0};
+        if (header.keyType == KEY_INT64 && header.keyLength == sizeof(int64_t))
+        {
+            int64_t intKey;
+            memcpy(&intKey, keyBytes, sizeof(intKey));
+            key.intValue = intKey;
+        }
+
+        switch (header.opcode)
+        {
+        case COMMAND_CREATE:
+        {
+            if (cache != NULL)
+            {
+                flushPendingPuts(cache, pending, &pendingCount);
+                freeCache(cache);
+            }
+            CacheConfig config = {(int)header.argument, 0, 1, EVICTION_LRU, false, false};
+            cache = createCacheWithConfig(&config);
+            break;
+        }
+        case COMMAND_PUT:
+        case COMMAND_PUT_TTL:
+            if (cache == NULL)
+                break;
+            pending[pendingCount++] = (BatchPut){key, value, valueLength, ttlMillis, false};
+            if (pendingCount == BATCH_CHUNK_SIZE)
+            {
+                flushPendingPuts(cache, pending, &pendingCount);
+            }
+            break;
+        case COMMAND_GET:
+        {
+            uint32_t length = COMMAND_MISS;
+            size_t resultLength = 0;
+            const char *result = NULL;
+            if (cache != NULL)
+            {
+                flushPendingPuts(cache, pending, &pendingCount);
+                result = cacheGetBytes(cache, key, &resultLength);
+            }
+            if (result != NULL)
+            {
+                length = (uint32_t)resultLength;
+            }
+            writeOutput(&output, &length, sizeof(length));
+            if (result != NULL)
+            {
+                writeOutput(&output, result, length);
+            }
+            break;
+        }
+        default:
+            ok = false;
+            break;
+        }
     }
-    insertAtHead(cache, newNode);
-    newNode->hashNext = cache->hashTable[hashIndex];
-    cache->hashTable[hashIndex] = newNode;
 
-    cache->count++;
+    if (cache != NULL)
+    {
+        flushPendingPuts(cache, pending, &pendingCount);
+        freeCache(cache);
+    }
+    flushOutput(&output);
+    fflush(stdout);
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Malformed command at offset %zu.\n", commandStart);
+    }
+    free(output.data);
+    if (mapped)
+    {
+        munmap(input, size);
+    }
+    else
+    {
+        free(input);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        return runBenchmark(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "batch") == 0)
+    {
+        return runCommandStream(argv[2]);
+    }
+
     char command[32];
-    int key;
+    char key[MAX_KEY_LENGTH];
     char value[MAX_VALUE_LENGTH];
     int capacity;
+    long long ttlMillis;
+    char path[MAX_VALUE_LENGTH];
     LruCache *cache = NULL;
     printf("Input:\n");
     while (scanf("%s", command) != EOF)
@@ -215,21 +3132,29 @@ int main()
             {
                 freeCache(cache);
             }
-            cache = createCache(capacity);
+            CacheConfig config = {capacity, 0, 1, EVICTION_LRU, true, false};
+            cache = createCacheWithConfig(&config);
         }
         else if (strcmp(command, "put") == 0)
         {
             if (cache == NULL)
                 continue;
-            scanf("%d %s", &key, value);
-            put(cache, key, value);
+            scanf("%255s %4095s", key, value);
+            cachePutValue(cache, parseKey(key), value, strlen(value));
+        }
+        else if (strcmp(command, "putttl") == 0)
+        {
+            if (cache == NULL)
+                continue;
+            scanf("%255s %lld %4095s", key, &ttlMillis, value);
+            cachePutValueWithTtl(cache, parseKey(key), value, strlen(value), ttlMillis);
         }
         else if (strcmp(command, "get") == 0)
         {
             if (cache == NULL)
                 continue;
-            scanf("%d", &key);
-            char *result = get(cache, key);
+            scanf("%255s", key);
+            char *result = cacheGet(cache, parseKey(key));
 
             if (result != NULL)
             {
@@ -240,6 +3165,28 @@ int main()
                 printf("NULL\n");
             }
         }
+        else if (strcmp(command, "save") == 0 || strcmp(command, "load") == 0)
+        {
+            scanf("%4095s", path);
+            if (cache == NULL)
+                continue;
+            bool saving = strcmp(command, "save") == 0;
+            long long entries = saving ? saveCache(cache, path) : loadCache(cache, path);
+            if (entries < 0)
+            {
+                printf("Error: Could not %s snapshot '%s'.\n", command, path);
+            }
+            else
+            {
+                printf("%s %lld entries\n", saving ? "Saved" : "Loaded", entries);
+            }
+        }
+        else if (strcmp(command, "stats") == 0)
+        {
+            if (cache == NULL)
+                continue;
+            printCacheStats(cache);
+        }
         else if (strcmp(command, "exit") == 0)
         {
             break;
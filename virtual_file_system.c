@@ -1,72 +1,308 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define NUM_BLOCKS 1024
 #define BLOCK_SIZE 512
-#define MAX_FILE_BLOCKS 32
+#define DEFAULT_CACHE_BYTES (256 * 1024)
+#define MAX_WRITEBACK_RUN 64
+#define MIN_INODES 256
+#define VFS_MAGIC 0x53465643u
+#define VFS_VERSION 5
+#define ROOT_INODE 1
+#define METADATA_ALIGN 4096
+#define INLINE_EXTENTS 12
+#define NO_BLOCK UINT32_MAX
+#define DIR_INDEX_THRESHOLD 8
+#define DENTRY_CACHE_SIZE 4096
+#define MAX_OUTPUT_SLICES 64
+#define TRANSFER_CHUNK_BLOCKS 2048
+#define JOURNAL_MAGIC 0x4C4E524Au
+#define JOURNAL_PAGE_SIZE 512
+#define GROUP_COMMIT_OPERATIONS 64
+#define GROUP_COMMIT_PAGES 256
+#define GROUP_COMMIT_MS 1000
+#define MAX_SNAPSHOTS 16
 #define MAX_NAME_LEN 50  
 #define MAX_INPUT_LEN 1024
 #define MAX_PATH_DEPTH 128 
 
-char gVirtualDisk[NUM_BLOCKS][BLOCK_SIZE];
+typedef struct Extent
+{
+    uint32_t start;
+    uint32_t length;
+} Extent;
+
+// Extents that do not fit in the inode spill into a chain of data blocks.
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(Extent))
+
+typedef struct ExtentBlock
+{
+    uint32_t nextBlock;
+    uint32_t count;
+    Extent extents[EXTENTS_PER_BLOCK];
+} ExtentBlock;
 
-typedef struct FreeBlock
+typedef struct ExtentList
 {
-    int blockIndex;
-    struct FreeBlock *prevBlock;
-    struct FreeBlock *nextBlock;
-} FreeBlock;
+    Extent *extents;
+    uint32_t count;
+    uint32_t capacity;
+} ExtentList;
 
 typedef enum
 {
+    FREE_NODE,
     FILETYPE,
     DIRECTORY
 } NodeType;
 
+// Nodes are the on-disk inodes: they live in the mapped inode table and
+// link to each other by inode number, 0 meaning none. Free inodes are
+// chained through nextSibling. A slot whose origin is set holds a copy of
+// inode `origin` saved for a snapshot, chained through nextSaved.
 typedef struct Node
 {
     char name[MAX_NAME_LEN + 1];
-    NodeType type;
-    struct Node *nextSibling;
-    struct Node *prevSibling;
-    struct Node *parent;
+    uint8_t type;
+    uint32_t nextSibling;
+    uint32_t prevSibling;
+    uint32_t parent;
+    uint32_t generation;
+    uint32_t origin;
+    uint32_t nextSaved;
 
     union
     {
         struct
         {
-            struct Node *child;
+            uint32_t child;
         } directory;
         struct
         {
-            int contentSize;
-            int blockPointers[MAX_FILE_BLOCKS];
+            uint64_t contentSize;
+            uint32_t extentCount;
+            uint32_t overflowBlock;
+            Extent extents[INLINE_EXTENTS];
         } file;
     };
 
 } Node;
 
+// A snapshot closes a generation. Nodes first changed after it are saved
+// on its chain, so the snapshot itself costs nothing to take.
+typedef struct Snapshot
+{
+    char name[MAX_NAME_LEN + 1];
+    uint32_t generation;
+    uint32_t savedHead;
+    uint32_t savedCount;
+} Snapshot;
+
+// Image layout: superblock, inode table, free-block bitmap, block share
+// counts, journal, data blocks. Everything before the journal is mapped
+// privately into memory and only reaches the image through the journal;
+// data blocks go through the block cache.
+typedef struct SuperBlock
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t inodeCount;
+    uint32_t freeInodeHead;
+    uint32_t freeInodeCount;
+    uint32_t freeBlockCount;
+    uint64_t inodeTableOffset;
+    uint64_t bitmapOffset;
+    uint64_t dataOffset;
+    uint64_t journalOffset;
+    uint64_t journalSize;
+    uint64_t journalSequence;
+    uint64_t shareCountOffset;
+    uint32_t generation;
+    uint32_t snapshotCount;
+    // Live nodes not yet copied for the latest snapshot; that many free
+    // inodes are held back from allocNode().
+    uint32_t snapshotReserve;
+    Snapshot snapshots[MAX_SNAPSHOTS];
+} SuperBlock;
+
+// A journal record is this header, the indices of the metadata pages it
+// carries padded to a page, then the page images. Records are valid only
+// in sequence order starting at the superblock's journalSequence.
+typedef struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t pageCount;
+    uint64_t sequence;
+    uint64_t checksum;
+} JournalHeader;
+
+// Metadata pages touched since the last commit, plus blocks freed since
+// then: those stay allocated until the commit that frees them is durable,
+// so data written after reuse can never land in a block that committed
+// metadata still points at.
+typedef struct Journal
+{
+    uint64_t *dirtyMap;
+    uint32_t *dirtyPages;
+    uint32_t dirtyCount;
+    uint32_t pageCount;
+    uint64_t tail;
+    uint64_t sequence;
+    uint32_t pendingOperations;
+    struct timespec firstChange;
+    ExtentList pendingFrees;
+    uint64_t pendingFreeBlocks;
+    uint64_t commits;
+    uint64_t pagesLogged;
+    uint64_t checkpoints;
+} Journal;
+
+typedef struct DirSlot
+{
+    uint32_t node;
+    uint32_t hash;
+} DirSlot;
+
+// In-memory name index of one directory: open addressing over inode
+// numbers, 0 marking an empty slot. The sibling list stays the source of
+// truth and keeps creation order for ls.
+typedef struct DirIndex
+{
+    DirSlot *slots;
+    uint32_t mask;
+    uint32_t count;
+} DirIndex;
+
+// Global lookup cache keyed by (parent inode, name). A child of 0 records
+// that the name is known to be absent, so repeated misses are cached too.
+typedef struct Dentry
+{
+    uint32_t parent;
+    uint32_t child;
+    uint32_t hash;
+    char name[MAX_NAME_LEN + 1];
+} Dentry;
+
+typedef enum
+{
+    BLOCK_READ,
+    BLOCK_OVERWRITE
+} BlockAccess;
+
+typedef struct CacheFrame
+{
+    uint32_t blockIndex;
+    uint16_t pinCount;
+    bool valid;
+    bool referenced;
+    bool dirty;
+} CacheFrame;
+
+// Fixed-budget cache of device blocks. Frames are found through an
+// open-addressed block index and evicted with a CLOCK hand; dirty frames
+// are only written back on eviction or sync, together with any dirty
+// neighbours so that sequential writes reach the host file as one pwritev.
+typedef struct BlockCache
+{
+    int fd;
+    uint64_t dataOffset;
+    uint32_t blockCount;
+    uint32_t frameCount;
+    uint32_t clockHand;
+    CacheFrame *frames;
+    char *frameData;
+    int32_t *slots;
+    uint32_t slotMask;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writeBacks;
+    uint64_t writeCalls;
+} BlockCache;
+
+BlockCache gBlockCache;
+Journal gJournal;
+int gImageFd = -1;
+char *gMetadata = NULL;
+size_t gMetadataSize = 0;
+SuperBlock *gSuper = NULL;
+Node *gInodes = NULL;
+uint64_t *gBlockBitmap = NULL;
+uint8_t *gShareCounts = NULL;
+DirIndex **gDirIndexes = NULL;
+Dentry gDentries[DENTRY_CACHE_SIZE];
+uint64_t gDentryHits = 0;
+uint64_t gDentryMisses = 0;
+uint64_t *gFreeSummary = NULL;
+uint32_t gBitmapWords = 0;
 Node *gRoot = NULL;
 Node *gCwd = NULL;
-FreeBlock *gFreeBlockHead = NULL;
-FreeBlock *gFreeBlockTail = NULL;
-int gFreeBlockCount = 0;
+char gCwdPath[MAX_INPUT_LEN] = "/";
 
 void initializeVfs();
 void cleanupMemory();
-void freeNodeRecursive(Node *node);
-void returnBlockToFreeList(int blockIndex);
-Node *findNodeInCwd(char *name);
+void mountVfs(const char *imagePath, uint32_t blockCount, uint32_t inodeCount, size_t cacheBytes);
+void unmountVfs();
+bool syncVfs();
+void touchMetadata(const void *address, size_t length);
+bool commitJournal();
+bool checkpointJournal();
+void endOperation();
+void waitForInput();
+Node *allocNode();
+void releaseNode(Node *node);
+void preserveNode(Node *node);
+uint32_t countLiveNodes();
+void rollbackToSnapshot(uint32_t index);
+void buildFreeSummary();
+uint32_t allocBlockRun(uint32_t wanted, uint32_t *runStart);
+uint32_t claimBlockRun(uint32_t runStart, uint32_t wanted);
+void freeBlockRun(uint32_t runStart, uint32_t runLength);
+void loadExtents(const Node *node, ExtentList *list);
+bool storeExtents(Node *node, const ExtentList *list);
+void appendExtent(ExtentList *list, uint32_t start, uint32_t length);
+void releaseExtents(const ExtentList *list);
+void truncateFile(Node *node);
+bool growFile(Node *node, ExtentList *extents, uint64_t extraBlocks);
+bool writeFileRange(Node *node, uint64_t offset, const char *data, uint64_t length);
+bool emitFileRange(int fd, const Node *node, uint64_t offset, uint64_t length);
+Node *resolvePath(const char *path, char *leafName);
+Node *lookupChild(Node *dir, const char *name);
+Node *findChild(Node *dir, const char *name);
+void linkChild(Node *dir, Node *node);
 bool removeFromCircularList(Node *node);
+void freeDirIndex(uint32_t dirId);
 int commandIs(char *command);
 int parseCommand(char *inputBuffer, char *command, char *argument);
 void buildCurrentPath(char *pathBuffer, size_t bufferSize);
+void initBlockCache(int fd, uint64_t dataOffset, uint32_t blockCount, size_t cacheBytes);
+void releaseBlockCache();
+char *cacheBlock(uint32_t blockIndex, BlockAccess access);
+const char *pinBlock(uint32_t blockIndex);
+void unpinBlock(uint32_t blockIndex);
+const ExtentBlock *readExtentBlock(uint32_t blockIndex);
+bool readDeviceRun(uint32_t runStart, uint32_t runLength, char *buffer);
+bool writeDeviceRun(uint32_t runStart, uint32_t runLength, const char *buffer);
+bool flushBlockCache();
 
 void callDf();
 void callMkdir(char *dirName);
-void callLs();
+void callLs(char *dirPath);
 void callCd(char *dirName);
 void callCreate(char *fileName);
 void callWrite(char *argument);
@@ -74,72 +310,107 @@ void callRead(char *fileName);
 void callDelete(char *fileName);
 void callRmdir(char *dirName);
 void callPwd();
+void callSync();
+void callPread(char *argument);
+void callPwrite(char *argument);
+void callAppend(char *argument);
+void callImport(char *argument);
+void callExport(char *argument);
+void callSnapshot(char *name);
+void callRollback(char *name);
+
+static inline Node *nodeAt(uint32_t id)
+{
+    return id == 0 ? NULL : &gInodes[id];
+}
+
+static inline uint32_t nodeId(const Node *node)
+{
+    return node == NULL ? 0 : (uint32_t)(node - gInodes);
+}
+
+// Every change to a node goes through here first, to journal it and to
+// save the old contents for the latest snapshot.
+static inline void touchNode(Node *node)
+{
+    preserveNode(node);
+    touchMetadata(node, sizeof(*node));
+}
+
+static inline uint64_t blocksForSize(uint64_t size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
 
 void initializeVfs()
 {
-    memset(gVirtualDisk, 0, sizeof(gVirtualDisk));
-    gRoot = (Node *)malloc(sizeof(Node));
-    if (gRoot == NULL)
+    gRoot = nodeAt(ROOT_INODE);
+    gCwd = gRoot;
+    buildFreeSummary();
+
+    gDirIndexes = (DirIndex **)calloc(gSuper->inodeCount, sizeof(DirIndex *));
+    if (gDirIndexes == NULL)
     {
-        printf("Error: Malloc failed during VFS initialization.\n");
+        printf("Error: Malloc failed during directory index creation.\n");
         exit(1);
     }
+}
 
-    strcpy(gRoot->name, "/");
-    gRoot->type = DIRECTORY;
-    gRoot->parent = NULL;
-    gRoot->nextSibling = gRoot;
-    gRoot->prevSibling = gRoot;
-    gRoot->directory.child = NULL;
-    gCwd = gRoot;
-
-    gFreeBlockHead = NULL;
-    gFreeBlockTail = NULL;
-    gFreeBlockCount = 0;
+int main(int argc, char *argv[])
+{
+    const char *imagePath = NULL;
+    long blockCount = NUM_BLOCKS;
+    long inodeCount = 0;
+    long cacheBytes = DEFAULT_CACHE_BYTES;
 
-    for (int i = 0; i < NUM_BLOCKS; i++)
+    for (int i = 1; i < argc; i++)
     {
-        FreeBlock *newBlock = (FreeBlock *)malloc(sizeof(FreeBlock));
-        if (newBlock == NULL)
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
         {
-            printf("Error: Malloc failed during Free Block creation.\n");
-            exit(1);
+            imagePath = argv[++i];
         }
-
-        newBlock->blockIndex = i;
-        newBlock->nextBlock = NULL;
-
-        if (gFreeBlockHead == NULL)
+        else if (strcmp(argv[i], "--blocks") == 0 && i + 1 < argc)
         {
-            newBlock->prevBlock = NULL;
-            gFreeBlockHead = newBlock;
-            gFreeBlockTail = newBlock;
+            blockCount = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc)
+        {
+            inodeCount = strtol(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--cache-bytes") == 0 && i + 1 < argc)
+        {
+            cacheBytes = strtol(argv[++i], NULL, 10);
         }
         else
         {
-            newBlock->prevBlock = gFreeBlockTail;
-            gFreeBlockTail->nextBlock = newBlock;
-            gFreeBlockTail = newBlock;
+            printf("Usage: %s [--image <path>] [--blocks <n>] [--inodes <n>] [--cache-bytes <n>]\n", argv[0]);
+            return 1;
         }
-        gFreeBlockCount++;
     }
-}
+    if (inodeCount == 0)
+    {
+        inodeCount = blockCount / 4 > MIN_INODES ? blockCount / 4 : MIN_INODES;
+    }
+    if (blockCount <= 0 || blockCount > INT32_MAX || inodeCount <= ROOT_INODE ||
+        inodeCount > INT32_MAX || cacheBytes < 2 * BLOCK_SIZE)
+    {
+        printf("Error: Invalid block count, inode count or cache size.\n");
+        return 1;
+    }
 
-int main()
-{
+    mountVfs(imagePath, (uint32_t)blockCount, (uint32_t)inodeCount, (size_t)cacheBytes);
     printf("Compact VFS - ready. Type 'exit' to quit.\n");
     initializeVfs();
 
     char command[MAX_NAME_LEN + 1];
     char argument[MAX_INPUT_LEN];
     char inputBuffer[MAX_INPUT_LEN];
-    char path[MAX_INPUT_LEN];
     int commandCode;
 
     do
     {
-        buildCurrentPath(path, sizeof(path));
-        printf("%s> ", path);
+        printf("%s> ", gCwdPath);
+        waitForInput();
 
         command[0] = '\0';
         argument[0] = '\0';
@@ -188,7 +459,7 @@ int main()
             callRmdir(argument);
             break;
         case 7:
-            callLs();
+            callLs(argument);
             break;
         case 8:
             callCd(argument);
@@ -201,11 +472,36 @@ int main()
             break;
         case 11:
             break;
+        case 12:
+            callSync();
+            break;
+        case 13:
+            callPread(argument);
+            break;
+        case 14:
+            callPwrite(argument);
+            break;
+        case 15:
+            callAppend(argument);
+            break;
+        case 16:
+            callImport(argument);
+            break;
+        case 17:
+            callExport(argument);
+            break;
+        case 18:
+            callSnapshot(argument);
+            break;
+        case 19:
+            callRollback(argument);
+            break;
         case 0:
         default:
             printf("Invalid Command: %s\n", command);
             break;
         }
+        endOperation();
 
     } while (commandCode != 11);
 
@@ -215,74 +511,116 @@ int main()
 
 void callDf()
 {
-    int freeCount = gFreeBlockCount;
-    int usedCount = NUM_BLOCKS - freeCount;
+    int totalCount = (int)gSuper->blockCount;
+    int freeCount = (int)(gSuper->freeBlockCount + gJournal.pendingFreeBlocks);
+    int usedCount = totalCount - freeCount;
     float diskUsage = 0.0;
-    if (NUM_BLOCKS > 0)
+    if (totalCount > 0)
     {
-        diskUsage = (float)usedCount * 100.0 / NUM_BLOCKS;
+        diskUsage = (float)usedCount * 100.0 / totalCount;
     }
 
-    printf("Total Blocks: %d\n", NUM_BLOCKS);
+    printf("Total Blocks: %d\n", totalCount);
     printf("Used Blocks:  %d\n", usedCount);
     printf("Free Blocks:  %d\n", freeCount);
     printf("Disk Usage:   %.2f%%\n", diskUsage);
+    printf("Inodes:       %u used, %u free\n", gSuper->inodeCount - 1 - gSuper->freeInodeCount,
+           gSuper->freeInodeCount);
+    printf("Dentries:     %llu hits, %llu misses\n", (unsigned long long)gDentryHits,
+           (unsigned long long)gDentryMisses);
+    printf("Cache:        %u frames, %llu hits, %llu misses, %llu blocks written in %llu calls\n",
+           gBlockCache.frameCount, (unsigned long long)gBlockCache.hits,
+           (unsigned long long)gBlockCache.misses, (unsigned long long)gBlockCache.writeBacks,
+           (unsigned long long)gBlockCache.writeCalls);
+    printf("Journal:      %llu commits, %llu pages logged, %llu checkpoints, %llu of %llu KiB in use\n",
+           (unsigned long long)gJournal.commits, (unsigned long long)gJournal.pagesLogged,
+           (unsigned long long)gJournal.checkpoints, (unsigned long long)(gJournal.tail / 1024),
+           (unsigned long long)(gSuper->journalSize / 1024));
+    uint32_t savedCount = 0;
+    for (uint32_t i = 0; i < gSuper->snapshotCount; i++)
+    {
+        savedCount += gSuper->snapshots[i].savedCount;
+    }
+    printf("Snapshots:    %u of %d, %u saved inodes\n", gSuper->snapshotCount, MAX_SNAPSHOTS, savedCount);
 }
 
-void callMkdir(char *dirName)
+// Resolves the directory a new entry at `path` goes into and checks the
+// new name, reporting any problem. Returns NULL if the entry cannot be made.
+static Node *resolveNewEntry(const char *path, char *leafName)
 {
-    if (dirName == NULL || dirName[0] == '\0')
+    Node *parent = resolvePath(path, leafName);
+    if (parent == NULL || parent->type != DIRECTORY)
     {
-        printf("Error: Missing directory name.\n");
-        return;
+        printf("Error: Parent directory not found.\n");
+        return NULL;
     }
-
-    if (strcmp(dirName, ".") == 0 || strcmp(dirName, "..") == 0 || strchr(dirName, '/') != NULL)
+    if (leafName[0] == '\0' || strcmp(leafName, ".") == 0 || strcmp(leafName, "..") == 0)
     {
         printf("Error: Invalid name. Cannot use '.', '..', or '/'.\n");
+        return NULL;
+    }
+    if (strlen(leafName) > MAX_NAME_LEN)
+    {
+        printf("Error: Name is too long (max %d characters).\n", MAX_NAME_LEN);
+        return NULL;
+    }
+    if (lookupChild(parent, leafName) != NULL)
+    {
+        printf("Error: Name already exists in current directory.\n");
+        return NULL;
+    }
+    return parent;
+}
+
+void callMkdir(char *dirName)
+{
+    if (dirName == NULL || dirName[0] == '\0')
+    {
+        printf("Error: Missing directory name.\n");
         return;
     }
 
-    if (findNodeInCwd(dirName) != NULL)
+    char leafName[MAX_INPUT_LEN];
+    Node *parent = resolveNewEntry(dirName, leafName);
+    if (parent == NULL)
     {
-        printf("Error: Name already exists in current directory.\n");
         return;
     }
 
-    Node *newDir = (Node *)malloc(sizeof(Node));
+    Node *newDir = allocNode();
     if (newDir == NULL)
     {
-        printf("Error: Memory allocation failed during new directory creation.\n");
+        printf("Error: No free inodes left for new directory.\n");
         return;
     }
 
-    strncpy(newDir->name, dirName, MAX_NAME_LEN);
-    newDir->name[MAX_NAME_LEN] = '\0';
+    strcpy(newDir->name, leafName);
     newDir->type = DIRECTORY;
-    newDir->parent = gCwd;
-    newDir->directory.child = NULL;
+    newDir->parent = nodeId(parent);
+    newDir->directory.child = 0;
 
-    Node *headChild = gCwd->directory.child;
-    if (headChild == NULL)
-    {
-        gCwd->directory.child = newDir;
-        newDir->nextSibling = newDir;
-        newDir->prevSibling = newDir;
-    }
-    else
-    {
-        Node *tail = headChild->prevSibling;
-        tail->nextSibling = newDir;
-        newDir->prevSibling = tail;
-        newDir->nextSibling = headChild;
-        headChild->prevSibling = newDir;
-    }
+    linkChild(parent, newDir);
     printf("Directory '%s' created successfully.\n", dirName);
 }
 
-void callLs()
+void callLs(char *dirPath)
 {
-    Node *headChild = gCwd->directory.child;
+    Node *dir = gCwd;
+    if (dirPath != NULL && dirPath[0] != '\0')
+    {
+        dir = resolvePath(dirPath, NULL);
+        if (dir == NULL)
+        {
+            printf("Error: Directory not found.\n");
+            return;
+        }
+        if (dir->type == FILETYPE)
+        {
+            printf("Error: '%s' is a file, not a directory.\n", dirPath);
+            return;
+        }
+    }
+    Node *headChild = nodeAt(dir->directory.child);
 
     if (headChild == NULL)
     {
@@ -298,7 +636,7 @@ void callLs()
             printf("/");
         }
         printf("\n");
-        current = current->nextSibling;
+        current = nodeAt(current->nextSibling);
     } while (current != headChild);
 }
 
@@ -310,28 +648,12 @@ void callCd(char *dirName)
         return;
     }
 
-    if (strcmp(dirName, "/") == 0)
-    {
-        gCwd = gRoot;
-        printf("Moved to /\n");
-        return;
-    }
-
-    if (strcmp(dirName, "..") == 0)
+    if (strcmp(dirName, "..") == 0 && gCwd == gRoot)
     {
-        if (gCwd->parent == NULL)
-        {
-            return;
-        }
-        gCwd = gCwd->parent;
-
-        char path[MAX_INPUT_LEN];
-        buildCurrentPath(path, sizeof(path));
-        printf("Moved to %s\n", path);
         return;
     }
 
-    Node *target = findNodeInCwd(dirName);
+    Node *target = resolvePath(dirName, NULL);
     if (target == NULL)
     {
         printf("Error: Directory not found.\n");
@@ -344,69 +666,56 @@ void callCd(char *dirName)
     }
 
     gCwd = target;
-    char path[MAX_INPUT_LEN];
-    buildCurrentPath(path, sizeof(path));
-    printf("Moved to %s\n", path);
+    buildCurrentPath(gCwdPath, sizeof(gCwdPath));
+    printf("Moved to %s\n", gCwdPath);
 }
 
-void callCreate(char *fileName)
+static Node *createFile(const char *fileName)
 {
-    if (fileName == NULL || fileName[0] == '\0')
-    {
-        printf("Error: Missing file name.\n");
-        return;
-    }
-    if (strcmp(fileName, ".") == 0 || strcmp(fileName, "..") == 0 || strchr(fileName, '/') != NULL)
+    char leafName[MAX_INPUT_LEN];
+    Node *parent = resolveNewEntry(fileName, leafName);
+    if (parent == NULL)
     {
-        printf("Error: Invalid name. Cannot use '.', '..', or '/'.\n");
-        return;
-    }
-
-    if (findNodeInCwd(fileName) != NULL)
-    {
-        printf("Error: Name already exists in current directory.\n");
-        return;
+        return NULL;
     }
 
-    Node *newFile = (Node *)malloc(sizeof(Node));
+    Node *newFile = allocNode();
     if (newFile == NULL)
     {
-        printf("Error: Memory allocation failed during file creation.\n");
-        return;
+        printf("Error: No free inodes left for file creation.\n");
+        return NULL;
     }
 
-    strncpy(newFile->name, fileName, MAX_NAME_LEN);
-    newFile->name[MAX_NAME_LEN] = '\0';
+    strcpy(newFile->name, leafName);
     newFile->type = FILETYPE;
-    newFile->parent = gCwd;
+    newFile->parent = nodeId(parent);
     newFile->file.contentSize = 0;
-    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
-    {
-        newFile->file.blockPointers[i] = -1;
-    }
+    newFile->file.extentCount = 0;
+    newFile->file.overflowBlock = NO_BLOCK;
 
-    Node *headChild = gCwd->directory.child;
-    if (headChild == NULL)
+    linkChild(parent, newFile);
+    return newFile;
+}
+
+void callCreate(char *fileName)
+{
+    if (fileName == NULL || fileName[0] == '\0')
     {
-        gCwd->directory.child = newFile;
-        newFile->nextSibling = newFile;
-        newFile->prevSibling = newFile;
+        printf("Error: Missing file name.\n");
+        return;
     }
-    else
+    if (createFile(fileName) != NULL)
     {
-        Node *tail = headChild->prevSibling;
-        tail->nextSibling = newFile;
-        newFile->prevSibling = tail;
-        newFile->nextSibling = headChild;
-        headChild->prevSibling = newFile;
+        printf("File '%s' created successfully.\n", fileName);
     }
-    printf("File '%s' created successfully.\n", fileName);
 }
 
-void callWrite(char *argument)
+// Splits "<file> [offset] 'content'" in place. The content is returned as
+// a slice of the argument buffer, so nothing is copied before it reaches
+// the file's blocks.
+static bool parseFileContent(char *argument, const char *usage, char *fileName, uint64_t *offset,
+                             const char **content, size_t *contentLen)
 {
-    char fileName[MAX_NAME_LEN + 1];
-    char content[MAX_INPUT_LEN];
     const char *contentPtr = NULL;
     const char *argPtr = argument;
 
@@ -416,14 +725,9 @@ void callWrite(char *argument)
         if (endQuote == NULL)
         {
             printf("Error: Invalid format. Unclosed quote in filename.\n");
-            return;
+            return false;
         }
         int len = endQuote - (argPtr + 1);
-        if (len > MAX_NAME_LEN)
-        {
-            printf("Error: Filename is too long.\n");
-            return;
-        }
         strncpy(fileName, argPtr + 1, len);
         fileName[len] = '\0';
         contentPtr = endQuote + 1;
@@ -433,15 +737,10 @@ void callWrite(char *argument)
         const char *firstSpace = strchr(argPtr, ' ');
         if (firstSpace == NULL)
         {
-            printf("Error: Invalid format. Missing content. Use: write <file> 'content'\n");
-            return;
+            printf("Error: Invalid format. Missing content. Use: %s\n", usage);
+            return false;
         }
         int len = firstSpace - argPtr;
-        if (len > MAX_NAME_LEN)
-        {
-            printf("Error: Filename is too long.\n");
-            return;
-        }
         strncpy(fileName, argPtr, len);
         fileName[len] = '\0';
         contentPtr = firstSpace;
@@ -452,10 +751,32 @@ void callWrite(char *argument)
         contentPtr++;
     }
 
+    if (offset != NULL)
+    {
+        char *end;
+        errno = 0;
+        *offset = strtoull(contentPtr, &end, 10);
+        if (*contentPtr == '-' || errno == ERANGE)
+        {
+            printf("Error: Invalid offset.\n");
+            return false;
+        }
+        if (end == contentPtr)
+        {
+            printf("Error: Invalid format. Missing offset. Use: %s\n", usage);
+            return false;
+        }
+        contentPtr = end;
+        while (*contentPtr == ' ')
+        {
+            contentPtr++;
+        }
+    }
+
     if (*contentPtr != '\'' && *contentPtr != '"')
     {
         printf("Error: Invalid format. Content must be in 'quotes' or \"quotes\".\n");
-        return;
+        return false;
     }
 
     char quoteChar = *contentPtr;
@@ -463,354 +784,2651 @@ void callWrite(char *argument)
     if (endContent == NULL)
     {
         printf("Error: Invalid format. Unclosed quote in content.\n");
-        return;
+        return false;
     }
 
-    int contentLen = endContent - (contentPtr + 1);
-    if (contentLen >= MAX_INPUT_LEN)
-    {
-        printf("Error: Content is too long (max %d bytes).\n", MAX_INPUT_LEN - 1);
-        return;
-    }
-    strncpy(content, contentPtr + 1, contentLen);
-    content[contentLen] = '\0';
+    *content = contentPtr + 1;
+    *contentLen = endContent - (contentPtr + 1);
+    return true;
+}
 
-    Node *node = findNodeInCwd(fileName);
+static Node *resolveFile(const char *fileName)
+{
+    Node *node = resolvePath(fileName, NULL);
     if (node == NULL)
     {
         printf("Error: File not found.\n");
-        return;
+        return NULL;
     }
     if (node->type == DIRECTORY)
     {
         printf("Error: '%s' is a directory.\n", fileName);
-        return;
+        return NULL;
     }
+    return node;
+}
 
-    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+void callWrite(char *argument)
+{
+    char fileName[MAX_INPUT_LEN];
+    const char *content;
+    size_t contentLen;
+    if (!parseFileContent(argument, "write <file> 'content'", fileName, NULL, &content, &contentLen))
     {
-        if (node->file.blockPointers[i] != -1)
-        {
-            returnBlockToFreeList(node->file.blockPointers[i]);
-            node->file.blockPointers[i] = -1;
-        }
-        else
-        {
-            break;
-        }
+        return;
     }
 
-    int dataSize = strlen(content);
-    int blocksNeeded = 0;
-    if (dataSize > 0)
-    {
-        blocksNeeded = (dataSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    }
-    if (blocksNeeded > MAX_FILE_BLOCKS)
+    Node *node = resolveFile(fileName);
+    if (node == NULL)
     {
-        printf("Error: File content is too large (max %d blocks).\n", MAX_FILE_BLOCKS);
         return;
     }
-    if (gFreeBlockCount < blocksNeeded)
+
+    truncateFile(node);
+    if (!writeFileRange(node, 0, content, contentLen))
     {
         printf("Error: Not enough free space on disk.\n");
         return;
     }
-    int dataRemaining = dataSize;
-    int contentOffset = 0;
-    for (int i = 0; i < blocksNeeded; i++)
-    {
-        FreeBlock *blockToUse = gFreeBlockHead;
-        gFreeBlockHead = blockToUse->nextBlock;
-        if (gFreeBlockHead)
-        {
-            gFreeBlockHead->prevBlock = NULL;
-        }
-        else
-        {
-            gFreeBlockTail = NULL;
-        }
-        int blockIdx = blockToUse->blockIndex;
-        node->file.blockPointers[i] = blockIdx;
-        int bytesToWrite = (dataRemaining > BLOCK_SIZE) ? BLOCK_SIZE : dataRemaining;
-        memcpy(gVirtualDisk[blockIdx], content + contentOffset, bytesToWrite);
-        contentOffset += bytesToWrite;
-        dataRemaining -= bytesToWrite;
-        free(blockToUse);
-        gFreeBlockCount--;
-    }
-    node->file.contentSize = dataSize;
-    printf("Data written successfully (size=%d bytes).\n", dataSize);
+    printf("Data written successfully (size=%d bytes).\n", (int)contentLen);
 }
 
-void callRead(char *fileName)
+void callPwrite(char *argument)
 {
-    Node *node = findNodeInCwd(fileName);
-    if (node == NULL)
+    char fileName[MAX_INPUT_LEN];
+    uint64_t offset;
+    const char *content;
+    size_t contentLen;
+    if (!parseFileContent(argument, "pwrite <file> <offset> 'content'", fileName, &offset, &content,
+                          &contentLen))
     {
-        printf("Error: File not found.\n");
         return;
     }
-    if (node->type == DIRECTORY)
+
+    Node *node = resolveFile(fileName);
+    if (node == NULL)
     {
-        printf("Error: '%s' is a directory.\n", fileName);
         return;
     }
-    if (node->file.contentSize == 0)
+    if (!writeFileRange(node, offset, content, contentLen))
     {
-        printf("(empty)\n");
+        printf("Error: Not enough free space on disk.\n");
         return;
     }
-    int dataRemaining = node->file.contentSize;
-    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
-    {
-        int blockIdx = node->file.blockPointers[i];
-        if (blockIdx == -1)
-            break;
-        int bytesToRead = (dataRemaining > BLOCK_SIZE) ? BLOCK_SIZE : dataRemaining;
-        for (int j = 0; j < bytesToRead; j++)
-        {
-            putchar(gVirtualDisk[blockIdx][j]);
-        }
-        dataRemaining -= bytesToRead;
-        if (dataRemaining <= 0)
-            break;
-    }
-    printf("\n");
+    printf("Wrote %zu bytes at offset %llu (size=%llu bytes).\n", contentLen, (unsigned long long)offset,
+           (unsigned long long)node->file.contentSize);
 }
 
-void callDelete(char *fileName)
+void callAppend(char *argument)
 {
-    Node *node = findNodeInCwd(fileName);
-    if (node == NULL)
+    char fileName[MAX_INPUT_LEN];
+    const char *content;
+    size_t contentLen;
+    if (!parseFileContent(argument, "append <file> 'content'", fileName, NULL, &content, &contentLen))
     {
-        printf("Error: File not found.\n");
         return;
     }
-    if (node->type == DIRECTORY)
+
+    Node *node = resolveFile(fileName);
+    if (node == NULL)
     {
-        printf("Error: '%s' is a directory. Use 'rmdir'.\n", fileName);
         return;
     }
-    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+    if (!writeFileRange(node, node->file.contentSize, content, contentLen))
     {
-        if (node->file.blockPointers[i] != -1)
-        {
-            returnBlockToFreeList(node->file.blockPointers[i]);
-        }
-        else
-        {
-            break;
-        }
+        printf("Error: Not enough free space on disk.\n");
+        return;
     }
-    removeFromCircularList(node);
-    free(node);
-    printf("File deleted successfully.\n");
+    printf("Appended %zu bytes (size=%llu bytes).\n", contentLen, (unsigned long long)node->file.contentSize);
 }
 
-void callRmdir(char *dirName)
+void callPread(char *argument)
 {
-    Node *node = findNodeInCwd(dirName);
-    if (node == NULL)
+    char fileName[MAX_INPUT_LEN];
+    unsigned long long offset;
+    unsigned long long length;
+    if (sscanf(argument, "%1023s %llu %llu", fileName, &offset, &length) != 3)
     {
-        printf("Error: Directory not found.\n");
+        printf("Error: Invalid format. Use: pread <file> <offset> <length>\n");
         return;
     }
-    if (node->type == FILETYPE)
+
+    Node *node = resolveFile(fileName);
+    if (node == NULL)
     {
-        printf("Error: '%s' is a file. Use 'delete'.\n", dirName);
         return;
     }
-    if (node->directory.child != NULL)
+    if (offset >= node->file.contentSize || length == 0)
     {
-        printf("Error: Directory not empty. Remove files first.\n");
+        printf("(empty)\n");
         return;
     }
-    removeFromCircularList(node);
-    free(node);
-    printf("Directory removed successfully.\n");
+    if (length > node->file.contentSize - offset)
+    {
+        length = node->file.contentSize - offset;
+    }
+    emitFileRange(STDOUT_FILENO, node, offset, length);
+    printf("\n");
 }
 
-void callPwd()
+static double elapsedSeconds(const struct timespec *start)
 {
-    char path[MAX_INPUT_LEN];
-    buildCurrentPath(path, sizeof(path));
-    printf("%s\n", path);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
-void cleanupMemory()
+static void reportTransfer(const char *verb, uint64_t bytes, double seconds)
 {
-    freeNodeRecursive(gRoot);
-    FreeBlock *current = gFreeBlockHead;
-    while (current != NULL)
+    double mebibytes = bytes / (1024.0 * 1024.0);
+    if (seconds > 0)
     {
-        FreeBlock *next = current->nextBlock;
-        free(current);
-        current = next;
+        printf("%s %llu bytes in %.3f s (%.2f MiB/s).\n", verb, (unsigned long long)bytes, seconds,
+               mebibytes / seconds);
     }
-    printf("Memory released. Exiting program...\n");
-}
-
-void freeNodeRecursive(Node *node)
-{
-    if (node == NULL)
-        return;
-    if (node->type == DIRECTORY && node->directory.child != NULL)
+    else
     {
-        Node *current = node->directory.child;
-        current->prevSibling->nextSibling = NULL;
-
-        while (current != NULL)
-        {
-            Node *next = current->nextSibling;
-            freeNodeRecursive(current);
-            current = next;
-        }
+        printf("%s %llu bytes.\n", verb, (unsigned long long)bytes);
     }
-    free(node);
 }
 
-bool removeFromCircularList(Node *node)
+// Blocks that truncating the file would give back: those no snapshot
+// copy still shares.
+static uint64_t countPrivateBlocks(const Node *node)
 {
-    if (node->parent == NULL)
-        return false;
-    Node *parent = node->parent;
-    Node *prev = node->prevSibling;
-    Node *next = node->nextSibling;
-    if (node == next)
+    uint64_t count = 0;
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    for (uint32_t i = 0; i < extents.count; i++)
     {
-        parent->directory.child = NULL;
-        return true;
+        for (uint32_t block = extents.extents[i].start; block < extents.extents[i].start + extents.extents[i].length;
+             block++)
+        {
+            count += gShareCounts[block] == 0;
+        }
     }
-    prev->nextSibling = next;
-    next->prevSibling = prev;
-    if (parent->directory.child == node)
+    free(extents.extents);
+    for (uint32_t block = node->file.overflowBlock; block != NO_BLOCK;)
     {
-        parent->directory.child = next;
+        count += gShareCounts[block] == 0;
+        block = readExtentBlock(block)->nextBlock;
     }
-    return false;
+    return count;
 }
 
-void returnBlockToFreeList(int blockIndex)
+// Allocates `size` bytes for an empty file and fills them from the host
+// file with multi-block reads and writes that bypass the block cache. The
+// file is left empty again on failure.
+static bool importBlocks(Node *node, int hostFd, const char *hostPath, uint64_t size, char *buffer)
 {
-    FreeBlock *newFreeNode = (FreeBlock *)malloc(sizeof(FreeBlock));
-    if (newFreeNode == NULL)
+    ExtentList extents = {NULL, 0, 0};
+    uint64_t blocks = blocksForSize(size);
+    if (blocks > 0 && !growFile(node, &extents, blocks))
     {
-        printf("Error: Malloc failed during freeing block.\n");
-        return;
+        printf("Error: Not enough free space on disk.\n");
+        free(extents.extents);
+        return false;
     }
-    newFreeNode->blockIndex = blockIndex;
-    newFreeNode->nextBlock = NULL;
-    if (gFreeBlockTail == NULL)
+
+    uint64_t remaining = size;
+    bool ok = true;
+    for (uint32_t i = 0; i < extents.count && ok; i++)
     {
-        newFreeNode->prevBlock = NULL;
-        gFreeBlockHead = newFreeNode;
-        gFreeBlockTail = newFreeNode;
+        for (uint32_t done = 0; done < extents.extents[i].length && ok;)
+        {
+            uint32_t runLength = extents.extents[i].length - done;
+            if (runLength > TRANSFER_CHUNK_BLOCKS)
+            {
+                runLength = TRANSFER_CHUNK_BLOCKS;
+            }
+            size_t chunkBytes = (size_t)runLength * BLOCK_SIZE;
+            size_t wanted = remaining < chunkBytes ? (size_t)remaining : chunkBytes;
+            size_t got = 0;
+            while (got < wanted)
+            {
+                ssize_t count = read(hostFd, buffer + got, wanted - got);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    break;
+                got += count;
+            }
+            if (got < wanted)
+            {
+                printf("Error: Short read from '%s'.\n", hostPath);
+                ok = false;
+                break;
+            }
+            memset(buffer + got, 0, chunkBytes - got);
+            ok = writeDeviceRun(extents.extents[i].start + done, runLength, buffer);
+            remaining -= got;
+            done += runLength;
+        }
+    }
+    free(extents.extents);
+
+    if (!ok)
+    {
+        truncateFile(node);
+        return false;
+    }
+    touchNode(node);
+    node->file.contentSize = size;
+    return true;
+}
+
+// Streams a host file into a VFS file, creating or replacing it. When the
+// disk has room for both copies, the data goes into a detached inode that
+// replaces the old contents only once the import has succeeded; otherwise
+// the old blocks are released first so the new contents can reuse them.
+void callImport(char *argument)
+{
+    char hostPath[MAX_INPUT_LEN];
+    char vfsPath[MAX_INPUT_LEN];
+    if (sscanf(argument, "%1023s %1023s", hostPath, vfsPath) != 2)
+    {
+        printf("Error: Invalid format. Use: import <hostpath> <vfsfile>\n");
+        return;
+    }
+
+    Node *node = resolvePath(vfsPath, NULL);
+    if (node != NULL && node->type == DIRECTORY)
+    {
+        printf("Error: '%s' is a directory.\n", vfsPath);
+        return;
+    }
+    int hostFd = open(hostPath, O_RDONLY);
+    struct stat info;
+    if (hostFd < 0 || fstat(hostFd, &info) != 0)
+    {
+        printf("Error: Cannot open '%s': %s\n", hostPath, strerror(errno));
+        if (hostFd >= 0)
+        {
+            close(hostFd);
+        }
+        return;
+    }
+    uint64_t size = (uint64_t)info.st_size;
+    uint64_t blocks = blocksForSize(size);
+    uint64_t available = gSuper->freeBlockCount + gJournal.pendingFreeBlocks;
+    uint64_t reclaimable = node != NULL ? countPrivateBlocks(node) : 0;
+    if (blocks > available + reclaimable)
+    {
+        printf("Error: Not enough free space on disk.\n");
+        close(hostFd);
+        return;
+    }
+    char *buffer = (char *)malloc((size_t)TRANSFER_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        printf("Error: Memory allocation failed for transfer buffer.\n");
+        close(hostFd);
+        return;
+    }
+    if (node == NULL && (node = createFile(vfsPath)) == NULL)
+    {
+        free(buffer);
+        close(hostFd);
+        return;
+    }
+
+    Node *staged = NULL;
+    if (node->file.extentCount > 0 && blocks <= available)
+    {
+        staged = allocNode();
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok;
+    if (staged != NULL)
+    {
+        staged->type = FILETYPE;
+        staged->file.overflowBlock = NO_BLOCK;
+        ok = importBlocks(staged, hostFd, hostPath, size, buffer);
+        if (ok)
+        {
+            // The staged inode's blocks move over to the target as they are.
+            truncateFile(node);
+            touchNode(node);
+            node->file = staged->file;
+        }
+        releaseNode(staged);
+    }
+    else
+    {
+        truncateFile(node);
+        ok = importBlocks(node, hostFd, hostPath, size, buffer);
+    }
+    double seconds = elapsedSeconds(&start);
+    free(buffer);
+    close(hostFd);
+
+    if (ok)
+    {
+        reportTransfer("Imported", size, seconds);
+    }
+}
+
+void callExport(char *argument)
+{
+    char vfsPath[MAX_INPUT_LEN];
+    char hostPath[MAX_INPUT_LEN];
+    if (sscanf(argument, "%1023s %1023s", vfsPath, hostPath) != 2)
+    {
+        printf("Error: Invalid format. Use: export <vfsfile> <hostpath>\n");
+        return;
+    }
+
+    Node *node = resolveFile(vfsPath);
+    if (node == NULL)
+    {
+        return;
+    }
+    int hostFd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (hostFd < 0)
+    {
+        printf("Error: Cannot open '%s': %s\n", hostPath, strerror(errno));
+        return;
+    }
+    char *buffer = (char *)malloc((size_t)TRANSFER_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        printf("Error: Memory allocation failed for transfer buffer.\n");
+        close(hostFd);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    uint64_t remaining = node->file.contentSize;
+    bool ok = true;
+    for (uint32_t i = 0; i < extents.count && remaining > 0 && ok; i++)
+    {
+        for (uint32_t done = 0; done < extents.extents[i].length && remaining > 0 && ok;)
+        {
+            uint32_t runLength = extents.extents[i].length - done;
+            if (runLength > TRANSFER_CHUNK_BLOCKS)
+            {
+                runLength = TRANSFER_CHUNK_BLOCKS;
+            }
+            size_t chunkBytes = (size_t)runLength * BLOCK_SIZE;
+            size_t wanted = remaining < chunkBytes ? (size_t)remaining : chunkBytes;
+            ok = readDeviceRun(extents.extents[i].start + done, runLength, buffer);
+            size_t written = 0;
+            while (ok && written < wanted)
+            {
+                ssize_t count = write(hostFd, buffer + written, wanted - written);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                {
+                    printf("Error: Write to '%s' failed: %s\n", hostPath, strerror(errno));
+                    ok = false;
+                    break;
+                }
+                written += count;
+            }
+            remaining -= wanted;
+            done += runLength;
+        }
+    }
+    free(extents.extents);
+    free(buffer);
+    if (close(hostFd) != 0)
+    {
+        ok = false;
+    }
+    if (ok)
+    {
+        reportTransfer("Exported", node->file.contentSize, elapsedSeconds(&start));
+    }
+}
+
+static int findSnapshot(const char *name)
+{
+    for (uint32_t i = 0; i < gSuper->snapshotCount; i++)
+    {
+        if (strcmp(gSuper->snapshots[i].name, name) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+// Taking a snapshot only closes the current generation; nodes are copied
+// lazily as they change. Without a name, the snapshots are listed.
+void callSnapshot(char *name)
+{
+    if (name[0] == '\0')
+    {
+        if (gSuper->snapshotCount == 0)
+        {
+            printf("No snapshots.\n");
+        }
+        for (uint32_t i = 0; i < gSuper->snapshotCount; i++)
+        {
+            printf("%s (%u saved inodes)\n", gSuper->snapshots[i].name, gSuper->snapshots[i].savedCount);
+        }
+        return;
+    }
+    if (strlen(name) > MAX_NAME_LEN)
+    {
+        printf("Error: Snapshot name too long.\n");
+        return;
+    }
+    if (findSnapshot(name) >= 0)
+    {
+        printf("Error: Snapshot '%s' already exists.\n", name);
+        return;
+    }
+    if (gSuper->snapshotCount == MAX_SNAPSHOTS)
+    {
+        printf("Error: No more than %d snapshots can be kept.\n", MAX_SNAPSHOTS);
+        return;
+    }
+    // Every live node may need a copy before the next snapshot, so there
+    // must be a free inode for each of them.
+    uint32_t unsaved = countLiveNodes();
+    if (unsaved > gSuper->freeInodeCount)
+    {
+        printf("Error: Not enough free inodes for snapshot copies (%u needed, %u free).\n", unsaved,
+               gSuper->freeInodeCount);
+        return;
+    }
+
+    touchMetadata(gSuper, sizeof(*gSuper));
+    Snapshot *snapshot = &gSuper->snapshots[gSuper->snapshotCount++];
+    memset(snapshot, 0, sizeof(*snapshot));
+    strcpy(snapshot->name, name);
+    snapshot->generation = gSuper->generation++;
+    gSuper->snapshotReserve = unsaved;
+    printf("Snapshot '%s' created.\n", name);
+}
+
+void callRollback(char *name)
+{
+    if (name[0] == '\0')
+    {
+        printf("Error: Missing snapshot name.\n");
+        return;
+    }
+    int index = findSnapshot(name);
+    if (index < 0)
+    {
+        printf("Error: Snapshot '%s' not found.\n", name);
+        return;
+    }
+    rollbackToSnapshot((uint32_t)index);
+    printf("Rolled back to snapshot '%s'.\n", name);
+}
+
+void callRead(char *fileName)
+{
+    Node *node = resolvePath(fileName, NULL);
+    if (node == NULL)
+    {
+        printf("Error: File not found.\n");
+        return;
+    }
+    if (node->type == DIRECTORY)
+    {
+        printf("Error: '%s' is a directory.\n", fileName);
+        return;
+    }
+    if (node->file.contentSize == 0)
+    {
+        printf("(empty)\n");
+        return;
+    }
+    emitFileRange(STDOUT_FILENO, node, 0, node->file.contentSize);
+    printf("\n");
+}
+
+void callDelete(char *fileName)
+{
+    Node *node = resolvePath(fileName, NULL);
+    if (node == NULL)
+    {
+        printf("Error: File not found.\n");
+        return;
+    }
+    if (node->type == DIRECTORY)
+    {
+        printf("Error: '%s' is a directory. Use 'rmdir'.\n", fileName);
+        return;
+    }
+    truncateFile(node);
+    removeFromCircularList(node);
+    releaseNode(node);
+    printf("File deleted successfully.\n");
+}
+
+void callRmdir(char *dirName)
+{
+    Node *node = resolvePath(dirName, NULL);
+    if (node == NULL)
+    {
+        printf("Error: Directory not found.\n");
+        return;
+    }
+    if (node->type == FILETYPE)
+    {
+        printf("Error: '%s' is a file. Use 'delete'.\n", dirName);
+        return;
+    }
+    if (node == gRoot || node == gCwd)
+    {
+        printf("Error: Cannot remove the root or current directory.\n");
+        return;
+    }
+    if (node->directory.child != 0)
+    {
+        printf("Error: Directory not empty. Remove files first.\n");
+        return;
+    }
+    removeFromCircularList(node);
+    releaseNode(node);
+    printf("Directory removed successfully.\n");
+}
+
+void callPwd()
+{
+    printf("%s\n", gCwdPath);
+}
+
+void callSync()
+{
+    if (syncVfs())
+    {
+        printf("Disk synced.\n");
+    }
+}
+
+void cleanupMemory()
+{
+    for (uint32_t i = 0; i < gSuper->inodeCount; i++)
+    {
+        freeDirIndex(i);
+    }
+    free(gDirIndexes);
+    unmountVfs();
+    free(gFreeSummary);
+    printf("Memory released. Exiting program...\n");
+}
+
+static uint32_t hashName(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name != '\0')
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void insertIntoDirIndex(DirIndex *index, uint32_t node, uint32_t hash)
+{
+    uint32_t slot = hash & index->mask;
+    while (index->slots[slot].node != 0)
+    {
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot].node = node;
+    index->slots[slot].hash = hash;
+    index->count++;
+}
+
+static void growDirIndex(DirIndex *index)
+{
+    DirSlot *oldSlots = index->slots;
+    uint32_t oldCapacity = oldSlots ? index->mask + 1 : 0;
+    uint32_t capacity = oldCapacity ? oldCapacity * 2 : 2 * DIR_INDEX_THRESHOLD;
+
+    index->slots = (DirSlot *)calloc(capacity, sizeof(DirSlot));
+    if (index->slots == NULL)
+    {
+        printf("Error: Malloc failed while growing directory index.\n");
+        exit(1);
+    }
+    index->mask = capacity - 1;
+    index->count = 0;
+    for (uint32_t i = 0; i < oldCapacity; i++)
+    {
+        if (oldSlots[i].node != 0)
+        {
+            insertIntoDirIndex(index, oldSlots[i].node, oldSlots[i].hash);
+        }
+    }
+    free(oldSlots);
+}
+
+static void addToDirIndex(DirIndex *index, const Node *node)
+{
+    if ((index->count + 1) * 2 > index->mask + 1)
+    {
+        growDirIndex(index);
+    }
+    insertIntoDirIndex(index, nodeId(node), hashName(node->name));
+}
+
+static void removeFromDirIndex(DirIndex *index, const Node *node)
+{
+    uint32_t id = nodeId(node);
+    uint32_t slot = hashName(node->name) & index->mask;
+    while (index->slots[slot].node != id)
+    {
+        slot = (slot + 1) & index->mask;
+    }
+    // Backward-shift the rest of the probe run so lookups never need tombstones.
+    uint32_t next = (slot + 1) & index->mask;
+    while (index->slots[next].node != 0)
+    {
+        uint32_t home = index->slots[next].hash & index->mask;
+        if (((next - home) & index->mask) >= ((next - slot) & index->mask))
+        {
+            index->slots[slot] = index->slots[next];
+            slot = next;
+        }
+        next = (next + 1) & index->mask;
+    }
+    index->slots[slot].node = 0;
+    index->count--;
+}
+
+void freeDirIndex(uint32_t dirId)
+{
+    if (gDirIndexes[dirId] != NULL)
+    {
+        free(gDirIndexes[dirId]->slots);
+        free(gDirIndexes[dirId]);
+        gDirIndexes[dirId] = NULL;
+    }
+}
+
+static Dentry *dentrySlot(uint32_t parent, uint32_t hash)
+{
+    return &gDentries[(hash ^ (parent * 2654435761u)) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+static void setDentry(uint32_t parent, const char *name, uint32_t hash, uint32_t child)
+{
+    Dentry *entry = dentrySlot(parent, hash);
+    entry->parent = parent;
+    entry->child = child;
+    entry->hash = hash;
+    strcpy(entry->name, name);
+}
+
+Node *lookupChild(Node *dir, const char *name)
+{
+    uint32_t hash = hashName(name);
+    Dentry *entry = dentrySlot(nodeId(dir), hash);
+    if (entry->parent == nodeId(dir) && entry->hash == hash && strcmp(entry->name, name) == 0)
+    {
+        gDentryHits++;
+        return nodeAt(entry->child);
+    }
+    gDentryMisses++;
+    Node *child = findChild(dir, name);
+    setDentry(nodeId(dir), name, hash, nodeId(child));
+    return child;
+}
+
+// Resolves an absolute or cwd-relative path through the dentry cache. With
+// leafName set, the last component is copied out instead of looked up and
+// the directory expected to hold it is returned.
+Node *resolvePath(const char *path, char *leafName)
+{
+    Node *current = (path[0] == '/') ? gRoot : gCwd;
+    char component[MAX_NAME_LEN + 1];
+    const char *cursor = path;
+
+    if (leafName != NULL)
+    {
+        leafName[0] = '\0';
+    }
+    for (;;)
+    {
+        while (*cursor == '/')
+        {
+            cursor++;
+        }
+        if (*cursor == '\0')
+            break;
+        size_t length = strcspn(cursor, "/");
+        const char *next = cursor + length;
+        while (*next == '/')
+        {
+            next++;
+        }
+        if (*next == '\0' && leafName != NULL)
+        {
+            memcpy(leafName, cursor, length);
+            leafName[length] = '\0';
+            break;
+        }
+        if (current->type != DIRECTORY || length > MAX_NAME_LEN)
+            return NULL;
+        memcpy(component, cursor, length);
+        component[length] = '\0';
+        cursor = next;
+
+        if (strcmp(component, ".") == 0)
+            continue;
+        if (strcmp(component, "..") == 0)
+        {
+            if (current->parent != 0)
+            {
+                current = nodeAt(current->parent);
+            }
+            continue;
+        }
+        current = lookupChild(current, component);
+        if (current == NULL)
+            return NULL;
+    }
+    return current;
+}
+
+// Small directories are scanned; a scan that has to walk past
+// DIR_INDEX_THRESHOLD entries builds the directory's index on the way out.
+Node *findChild(Node *dir, const char *name)
+{
+    DirIndex *index = gDirIndexes[nodeId(dir)];
+    if (index != NULL)
+    {
+        uint32_t hash = hashName(name);
+        for (uint32_t slot = hash & index->mask; index->slots[slot].node != 0; slot = (slot + 1) & index->mask)
+        {
+            Node *candidate = nodeAt(index->slots[slot].node);
+            if (index->slots[slot].hash == hash && strcmp(candidate->name, name) == 0)
+                return candidate;
+        }
+        return NULL;
+    }
+
+    Node *headChild = nodeAt(dir->directory.child);
+    if (headChild == NULL)
+    {
+        return NULL;
+    }
+    Node *found = NULL;
+    uint32_t entries = 0;
+    Node *current = headChild;
+    do
+    {
+        if (strcmp(current->name, name) == 0)
+        {
+            found = current;
+        }
+        entries++;
+        current = nodeAt(current->nextSibling);
+    } while (current != headChild && found == NULL);
+
+    if (entries >= DIR_INDEX_THRESHOLD)
+    {
+        index = (DirIndex *)calloc(1, sizeof(DirIndex));
+        if (index == NULL)
+        {
+            printf("Error: Malloc failed during directory index creation.\n");
+            exit(1);
+        }
+        growDirIndex(index);
+        current = headChild;
+        do
+        {
+            addToDirIndex(index, current);
+            current = nodeAt(current->nextSibling);
+        } while (current != headChild);
+        gDirIndexes[nodeId(dir)] = index;
+    }
+    return found;
+}
+
+void linkChild(Node *dir, Node *node)
+{
+    Node *headChild = nodeAt(dir->directory.child);
+    touchNode(node);
+    if (headChild == NULL)
+    {
+        touchNode(dir);
+        dir->directory.child = nodeId(node);
+        node->nextSibling = nodeId(node);
+        node->prevSibling = nodeId(node);
+    }
+    else
+    {
+        Node *tail = nodeAt(headChild->prevSibling);
+        touchNode(tail);
+        touchNode(headChild);
+        tail->nextSibling = nodeId(node);
+        node->prevSibling = nodeId(tail);
+        node->nextSibling = nodeId(headChild);
+        headChild->prevSibling = nodeId(node);
+    }
+    if (gDirIndexes[nodeId(dir)] != NULL)
+    {
+        addToDirIndex(gDirIndexes[nodeId(dir)], node);
+    }
+    setDentry(nodeId(dir), node->name, hashName(node->name), nodeId(node));
+}
+
+bool removeFromCircularList(Node *node)
+{
+    if (node->parent == 0)
+        return false;
+    Node *parent = nodeAt(node->parent);
+    if (gDirIndexes[node->parent] != NULL)
+    {
+        removeFromDirIndex(gDirIndexes[node->parent], node);
+    }
+    setDentry(node->parent, node->name, hashName(node->name), 0);
+    Node *prev = nodeAt(node->prevSibling);
+    Node *next = nodeAt(node->nextSibling);
+    touchNode(parent);
+    touchNode(prev);
+    touchNode(next);
+    if (node == next)
+    {
+        parent->directory.child = 0;
+        return true;
+    }
+    prev->nextSibling = nodeId(next);
+    next->prevSibling = nodeId(prev);
+    if (parent->directory.child == nodeId(node))
+    {
+        parent->directory.child = nodeId(next);
+    }
+    return false;
+}
+
+// One summary bit per bitmap word, set while that word still has a free
+// block, lets the allocator skip 4096 fully used blocks per summary word.
+void buildFreeSummary()
+{
+    gBitmapWords = (gSuper->blockCount + 63) / 64;
+    uint32_t tailBits = gSuper->blockCount % 64;
+    if (tailBits != 0)
+    {
+        // Bits past the end of the disk are permanently in use.
+        gBlockBitmap[gBitmapWords - 1] |= ~0ull << tailBits;
+        touchMetadata(&gBlockBitmap[gBitmapWords - 1], sizeof(uint64_t));
+    }
+
+    gFreeSummary = (uint64_t *)calloc((gBitmapWords + 63) / 64, sizeof(uint64_t));
+    if (gFreeSummary == NULL)
+    {
+        printf("Error: Malloc failed during free space summary creation.\n");
+        exit(1);
+    }
+    for (uint32_t word = 0; word < gBitmapWords; word++)
+    {
+        if (gBlockBitmap[word] != ~0ull)
+        {
+            gFreeSummary[word / 64] |= 1ull << (word % 64);
+        }
+    }
+}
+
+static void markBlockRun(uint32_t runStart, uint32_t runLength, bool used)
+{
+    uint32_t block = runStart;
+    uint32_t end = runStart + runLength;
+    if (runLength > 0)
+    {
+        touchMetadata(&gBlockBitmap[runStart / 64], ((end - 1) / 64 - runStart / 64 + 1) * sizeof(uint64_t));
+    }
+    while (block < end)
+    {
+        uint32_t word = block / 64;
+        uint32_t bit = block % 64;
+        uint32_t count = (end - block < 64 - bit) ? end - block : 64 - bit;
+        uint64_t mask = (count == 64) ? ~0ull : ((1ull << count) - 1) << bit;
+        if (used)
+        {
+            gBlockBitmap[word] |= mask;
+        }
+        else
+        {
+            gBlockBitmap[word] &= ~mask;
+        }
+
+        if (gBlockBitmap[word] == ~0ull)
+        {
+            gFreeSummary[word / 64] &= ~(1ull << (word % 64));
+        }
+        else
+        {
+            gFreeSummary[word / 64] |= 1ull << (word % 64);
+        }
+        block += count;
+    }
+}
+
+// Finds the first free run of at least `wanted` blocks, falling back to
+// the longest free run on a fragmented disk, and marks it used. Returns the
+// run length, which is 0 only when the disk is full.
+uint32_t allocBlockRun(uint32_t wanted, uint32_t *runStart)
+{
+    uint32_t currentStart = 0;
+    uint32_t currentLength = 0;
+    uint32_t bestStart = 0;
+    uint32_t bestLength = 0;
+    uint32_t previousWord = UINT32_MAX;
+    uint32_t summaryWords = (gBitmapWords + 63) / 64;
+
+    for (uint32_t summary = 0; summary < summaryWords && bestLength < wanted; summary++)
+    {
+        uint64_t candidates = gFreeSummary[summary];
+        while (candidates != 0 && bestLength < wanted)
+        {
+            uint32_t word = summary * 64 + __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            if (word != previousWord + 1)
+            {
+                currentLength = 0;
+            }
+            previousWord = word;
+
+            uint64_t freeBits = ~gBlockBitmap[word];
+            uint32_t bit = 0;
+            while (bit < 64)
+            {
+                uint64_t remaining = freeBits >> bit;
+                if (remaining == 0)
+                {
+                    currentLength = 0;
+                    break;
+                }
+                uint32_t used = __builtin_ctzll(remaining);
+                if (used > 0)
+                {
+                    currentLength = 0;
+                    bit += used;
+                    remaining >>= used;
+                }
+                uint32_t run = (remaining == ~0ull) ? 64 : __builtin_ctzll(~remaining);
+                if (currentLength == 0)
+                {
+                    currentStart = word * 64 + bit;
+                }
+                currentLength += run;
+                bit += run;
+                if (currentLength > bestLength)
+                {
+                    bestStart = currentStart;
+                    bestLength = currentLength;
+                    if (bestLength >= wanted)
+                        break;
+                }
+            }
+        }
+    }
+
+    if (bestLength > wanted)
+    {
+        bestLength = wanted;
+    }
+    if (bestLength > 0)
+    {
+        markBlockRun(bestStart, bestLength, true);
+        gSuper->freeBlockCount -= bestLength;
+        touchMetadata(gSuper, sizeof(*gSuper));
+    }
+    *runStart = bestStart;
+    return bestLength;
+}
+
+// The blocks only become allocatable again once the journal commits.
+void freeBlockRun(uint32_t runStart, uint32_t runLength)
+{
+    appendExtent(&gJournal.pendingFrees, runStart, runLength);
+    gJournal.pendingFreeBlocks += runLength;
+}
+
+// Claims up to `wanted` free blocks starting exactly at runStart, so a
+// growing file can extend its last extent in place. Returns the count.
+uint32_t claimBlockRun(uint32_t runStart, uint32_t wanted)
+{
+    uint32_t length = 0;
+    while (length < wanted && runStart + length < gSuper->blockCount)
+    {
+        uint32_t block = runStart + length;
+        uint64_t freeBits = ~gBlockBitmap[block / 64] >> (block % 64);
+        uint32_t run = (freeBits == ~0ull) ? 64 : __builtin_ctzll(~freeBits);
+        if (run == 0)
+            break;
+        length += (run < wanted - length) ? run : wanted - length;
+        if (run < 64 - block % 64)
+            break;
+    }
+    if (length > 0)
+    {
+        markBlockRun(runStart, length, true);
+        gSuper->freeBlockCount -= length;
+        touchMetadata(gSuper, sizeof(*gSuper));
+    }
+    return length;
+}
+
+// Whether `count` blocks can be allocated right now. Blocks freed earlier
+// in the journal group only come back with a commit, so one is forced when
+// they would make the difference.
+static bool reserveBlocks(uint64_t count)
+{
+    if (count > gSuper->freeBlockCount && count <= gSuper->freeBlockCount + gJournal.pendingFreeBlocks)
+    {
+        commitJournal();
+    }
+    return count <= gSuper->freeBlockCount;
+}
+
+// A block's share count is the number of references it has beyond the
+// first; blocks are only shared between a node and its snapshot copies.
+static void shareBlockRun(uint32_t runStart, uint32_t runLength)
+{
+    touchMetadata(&gShareCounts[runStart], runLength);
+    for (uint32_t i = 0; i < runLength; i++)
+    {
+        gShareCounts[runStart + i]++;
+    }
+}
+
+// Drops one reference to each block, freeing the ones nothing else shares.
+static void dropBlockRun(uint32_t runStart, uint32_t runLength)
+{
+    uint32_t end = runStart + runLength;
+    uint32_t block = runStart;
+    while (block < end)
+    {
+        uint32_t run = block;
+        while (run < end && gShareCounts[run] == 0)
+        {
+            run++;
+        }
+        if (run > block)
+        {
+            freeBlockRun(block, run - block);
+            block = run;
+            continue;
+        }
+        touchMetadata(&gShareCounts[block], 1);
+        gShareCounts[block]--;
+        block++;
+    }
+}
+
+void loadExtents(const Node *node, ExtentList *list)
+{
+    list->count = 0;
+    if (list->capacity < node->file.extentCount)
+    {
+        Extent *grown = (Extent *)realloc(list->extents, node->file.extentCount * sizeof(Extent));
+        if (grown == NULL)
+        {
+            printf("Error: Malloc failed while loading file extents.\n");
+            exit(1);
+        }
+        list->extents = grown;
+        list->capacity = node->file.extentCount;
+    }
+
+    uint32_t inlineCount = node->file.extentCount < INLINE_EXTENTS ? node->file.extentCount : INLINE_EXTENTS;
+    if (inlineCount > 0)
+    {
+        memcpy(list->extents, node->file.extents, inlineCount * sizeof(Extent));
+    }
+    list->count = inlineCount;
+    for (uint32_t block = node->file.overflowBlock; block != NO_BLOCK;)
+    {
+        const ExtentBlock *overflow = readExtentBlock(block);
+        memcpy(list->extents + list->count, overflow->extents, overflow->count * sizeof(Extent));
+        list->count += overflow->count;
+        block = overflow->nextBlock;
+    }
+}
+
+// Rewrites the inode's extent map from `list`, replacing its overflow
+// chain. Fails without touching the inode if no blocks are left for the
+// chain.
+bool storeExtents(Node *node, const ExtentList *list)
+{
+    uint32_t overflowCount = list->count > INLINE_EXTENTS ? list->count - INLINE_EXTENTS : 0;
+    uint32_t chainLength = (overflowCount + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+
+    // The old chain is only freed once the journal commits, so the new one
+    // needs free blocks of its own.
+    if (chainLength > gSuper->freeBlockCount)
+        return false;
+
+    touchNode(node);
+    for (uint32_t block = node->file.overflowBlock; block != NO_BLOCK;)
+    {
+        uint32_t next = readExtentBlock(block)->nextBlock;
+        dropBlockRun(block, 1);
+        block = next;
+    }
+
+    uint32_t inlineCount = list->count - overflowCount;
+    if (inlineCount > 0)
+    {
+        memcpy(node->file.extents, list->extents, inlineCount * sizeof(Extent));
+    }
+    node->file.extentCount = list->count;
+    node->file.overflowBlock = NO_BLOCK;
+
+    // Build the chain back to front so each block can point at its successor.
+    uint32_t next = NO_BLOCK;
+    for (uint32_t link = chainLength; link > 0; link--)
+    {
+        uint32_t block;
+        allocBlockRun(1, &block);
+        uint32_t first = INLINE_EXTENTS + (link - 1) * EXTENTS_PER_BLOCK;
+        ExtentBlock *overflow = (ExtentBlock *)cacheBlock(block, BLOCK_OVERWRITE);
+        memset(overflow, 0, BLOCK_SIZE);
+        overflow->nextBlock = next;
+        overflow->count = (list->count - first < EXTENTS_PER_BLOCK) ? list->count - first : EXTENTS_PER_BLOCK;
+        memcpy(overflow->extents, list->extents + first, overflow->count * sizeof(Extent));
+        next = block;
+    }
+    node->file.overflowBlock = next;
+    return true;
+}
+
+void appendExtent(ExtentList *list, uint32_t start, uint32_t length)
+{
+    if (list->count > 0)
+    {
+        Extent *last = &list->extents[list->count - 1];
+        if (last->start + last->length == start)
+        {
+            last->length += length;
+            return;
+        }
+    }
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : INLINE_EXTENTS;
+        Extent *grown = (Extent *)realloc(list->extents, capacity * sizeof(Extent));
+        if (grown == NULL)
+        {
+            printf("Error: Malloc failed while growing file extents.\n");
+            exit(1);
+        }
+        list->extents = grown;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].start = start;
+    list->extents[list->count].length = length;
+    list->count++;
+}
+
+void releaseExtents(const ExtentList *list)
+{
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        dropBlockRun(list->extents[i].start, list->extents[i].length);
+    }
+}
+
+void truncateFile(Node *node)
+{
+    touchNode(node);
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    releaseExtents(&extents);
+    extents.count = 0;
+    storeExtents(node, &extents);
+    free(extents.extents);
+    node->file.contentSize = 0;
+}
+
+// Maps a logical file block to its disk block. Lookups must move forward
+// through the file; *index and *base remember the extent reached so far.
+static uint32_t mapFileBlock(const ExtentList *extents, uint64_t logical, uint32_t *index, uint64_t *base)
+{
+    while (logical >= *base + extents->extents[*index].length)
+    {
+        *base += extents->extents[*index].length;
+        (*index)++;
+    }
+    return extents->extents[*index].start + (uint32_t)(logical - *base);
+}
+
+// Adds extraBlocks to the end of the file's map, extending the last extent
+// in place when the following blocks are free.
+bool growFile(Node *node, ExtentList *extents, uint64_t extraBlocks)
+{
+    if (!reserveBlocks(extraBlocks))
+        return false;
+
+    ExtentList fresh = {NULL, 0, 0};
+    uint32_t remaining = (uint32_t)extraBlocks;
+    if (extents->count > 0)
+    {
+        const Extent *last = &extents->extents[extents->count - 1];
+        uint32_t claimed = claimBlockRun(last->start + last->length, remaining);
+        if (claimed > 0)
+        {
+            appendExtent(&fresh, last->start + last->length, claimed);
+            remaining -= claimed;
+        }
+    }
+    while (remaining > 0)
+    {
+        uint32_t runStart;
+        uint32_t runLength = allocBlockRun(remaining, &runStart);
+        appendExtent(&fresh, runStart, runLength);
+        remaining -= runLength;
+    }
+
+    uint32_t oldCount = extents->count;
+    Extent oldLast = {0, 0};
+    if (oldCount > 0)
+    {
+        oldLast = extents->extents[oldCount - 1];
+    }
+    for (uint32_t i = 0; i < fresh.count; i++)
+    {
+        appendExtent(extents, fresh.extents[i].start, fresh.extents[i].length);
+    }
+    bool stored = storeExtents(node, extents);
+    if (!stored)
+    {
+        releaseExtents(&fresh);
+        extents->count = oldCount;
+        if (oldCount > 0)
+        {
+            extents->extents[oldCount - 1] = oldLast;
+        }
+    }
+    free(fresh.extents);
+    return stored;
+}
+
+// Gives the file private copies of the blocks in [first, end) that a
+// snapshot still shares, so that writing them in place leaves the snapshot
+// intact. Fails before changing anything when the disk is too full; a
+// block that cannot be read stays shared and also fails the call.
+static bool unshareFileBlocks(Node *node, ExtentList *extents, uint64_t first, uint64_t end)
+{
+    uint64_t shared = 0;
+    uint32_t index = 0;
+    uint64_t base = 0;
+    for (uint64_t logical = first; logical < end; logical++)
+    {
+        if (gShareCounts[mapFileBlock(extents, logical, &index, &base)] > 0)
+        {
+            shared++;
+        }
+    }
+    if (shared == 0)
+        return true;
+    // Each copied block can split an extent in two; leave room for the
+    // overflow chain that may need.
+    uint64_t chainBlocks = (extents->count + 2 * shared + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    if (!reserveBlocks(shared + chainBlocks))
+        return false;
+
+    ExtentList remapped = {NULL, 0, 0};
+    bool copied = true;
+    base = 0;
+    for (uint32_t i = 0; i < extents->count; i++)
+    {
+        Extent extent = extents->extents[i];
+        uint64_t low = first > base ? first : base;
+        uint64_t high = end < base + extent.length ? end : base + extent.length;
+        if (low >= high)
+        {
+            appendExtent(&remapped, extent.start, extent.length);
+            base += extent.length;
+            continue;
+        }
+        if (low > base)
+        {
+            appendExtent(&remapped, extent.start, (uint32_t)(low - base));
+        }
+        for (uint64_t logical = low; logical < high; logical++)
+        {
+            uint32_t block = extent.start + (uint32_t)(logical - base);
+            if (gShareCounts[block] == 0)
+            {
+                appendExtent(&remapped, block, 1);
+                continue;
+            }
+            // Copied through the stack, so no frame stays pinned while the
+            // copy's frame is loaded.
+            const char *source = cacheBlock(block, BLOCK_READ);
+            if (source == NULL)
+            {
+                appendExtent(&remapped, block, 1);
+                copied = false;
+                continue;
+            }
+            uint32_t copy;
+            char contents[BLOCK_SIZE];
+            memcpy(contents, source, BLOCK_SIZE);
+            allocBlockRun(1, &copy);
+            memcpy(cacheBlock(copy, BLOCK_OVERWRITE), contents, BLOCK_SIZE);
+            dropBlockRun(block, 1);
+            appendExtent(&remapped, copy, 1);
+        }
+        if (high < base + extent.length)
+        {
+            appendExtent(&remapped, extent.start + (uint32_t)(high - base),
+                         (uint32_t)(base + extent.length - high));
+        }
+        base += extent.length;
+    }
+    free(extents->extents);
+    *extents = remapped;
+    return storeExtents(node, extents) && copied;
+}
+
+// Copies one block of the file into `contents`.
+static bool readPartialBlock(const ExtentList *extents, uint64_t logical, char *contents)
+{
+    uint32_t index = 0;
+    uint64_t base = 0;
+    const char *data = cacheBlock(mapFileBlock(extents, logical, &index, &base), BLOCK_READ);
+    if (data == NULL)
+        return false;
+    memcpy(contents, data, BLOCK_SIZE);
+    return true;
+}
+
+// Writes `length` bytes at `offset`, allocating blocks past the current end
+// of file. Only blocks overlapping the range are touched; blocks the write
+// covers completely are overwritten in the cache without being read.
+bool writeFileRange(Node *node, uint64_t offset, const char *data, uint64_t length)
+{
+    // Bound the range by the disk size first so none of the sums below wrap.
+    uint64_t diskBytes = (uint64_t)gSuper->blockCount * BLOCK_SIZE;
+    if (length > diskBytes || offset > diskBytes - length)
+        return false;
+
+    uint64_t oldSize = node->file.contentSize;
+    uint64_t endOffset = offset + length;
+    uint64_t newSize = endOffset > oldSize ? endOffset : oldSize;
+    uint64_t oldBlocks = blocksForSize(oldSize);
+    uint64_t newBlocks = blocksForSize(newSize);
+    if (newBlocks > gSuper->blockCount)
+        return false;
+
+    touchNode(node);
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    uint64_t firstBlock = offset / BLOCK_SIZE;
+    uint64_t lastBlock = (endOffset - 1) / BLOCK_SIZE;
+
+    // Existing blocks the write covers only partly are read before anything
+    // changes, so a failed read leaves the file as it was.
+    char head[BLOCK_SIZE];
+    char tail[BLOCK_SIZE];
+    bool headPartial = offset % BLOCK_SIZE != 0 || endOffset < (firstBlock + 1) * BLOCK_SIZE;
+    bool tailPartial = lastBlock != firstBlock && endOffset % BLOCK_SIZE != 0;
+    if (length > 0 && ((headPartial && firstBlock < oldBlocks && !readPartialBlock(&extents, firstBlock, head)) ||
+                       (tailPartial && lastBlock < oldBlocks && !readPartialBlock(&extents, lastBlock, tail))))
+    {
+        free(extents.extents);
+        return false;
+    }
+    uint64_t sharedEnd = blocksForSize(endOffset) < oldBlocks ? blocksForSize(endOffset) : oldBlocks;
+    if (gSuper->snapshotCount > 0 && firstBlock < sharedEnd &&
+        !unshareFileBlocks(node, &extents, firstBlock, sharedEnd))
+    {
+        free(extents.extents);
+        return false;
+    }
+    if (newBlocks > oldBlocks && !growFile(node, &extents, newBlocks - oldBlocks))
+    {
+        free(extents.extents);
+        return false;
+    }
+
+    // Fresh blocks hold stale disk contents; zero the ones the write leaves
+    // wholly uncovered so the file reads back zeros in any gap.
+    uint32_t index = 0;
+    uint64_t base = 0;
+    for (uint64_t logical = oldBlocks; logical < newBlocks; logical++)
+    {
+        if (length > 0 && firstBlock <= logical && logical <= lastBlock)
+            continue;
+        memset(cacheBlock(mapFileBlock(&extents, logical, &index, &base), BLOCK_OVERWRITE), 0, BLOCK_SIZE);
+    }
+
+    index = 0;
+    base = 0;
+    uint64_t position = offset;
+    while (position < endOffset)
+    {
+        uint64_t logical = position / BLOCK_SIZE;
+        uint32_t within = position % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - within;
+        if (chunk > endOffset - position)
+        {
+            chunk = (uint32_t)(endOffset - position);
+        }
+        char *blockData = cacheBlock(mapFileBlock(&extents, logical, &index, &base), BLOCK_OVERWRITE);
+        if (chunk < BLOCK_SIZE)
+        {
+            if (logical >= oldBlocks)
+            {
+                memset(blockData, 0, BLOCK_SIZE);
+            }
+            else
+            {
+                memcpy(blockData, logical == firstBlock ? head : tail, BLOCK_SIZE);
+            }
+        }
+        memcpy(blockData + within, data + (position - offset), chunk);
+        position += chunk;
+    }
+
+    free(extents.extents);
+    touchNode(node);
+    node->file.contentSize = newSize;
+    return true;
+}
+
+static bool writeSlices(int fd, struct iovec *slices, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, slices, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && (size_t)written >= slices->iov_len)
+        {
+            written -= slices->iov_len;
+            slices++;
+            count--;
+        }
+        if (count > 0)
+        {
+            slices->iov_base = (char *)slices->iov_base + written;
+            slices->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Sends a byte range of the file to `fd` straight from pinned cache frames,
+// up to MAX_OUTPUT_SLICES block-sized slices per writev.
+bool emitFileRange(int fd, const Node *node, uint64_t offset, uint64_t length)
+{
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+
+    // Leave at least one frame unpinned so the cache can always load a block.
+    int sliceLimit = MAX_OUTPUT_SLICES;
+    if ((uint32_t)sliceLimit >= gBlockCache.frameCount)
+    {
+        sliceLimit = gBlockCache.frameCount > 1 ? (int)gBlockCache.frameCount - 1 : 1;
+    }
+    struct iovec slices[MAX_OUTPUT_SLICES];
+    uint32_t pinned[MAX_OUTPUT_SLICES];
+    int count = 0;
+    bool ok = true;
+
+    if (fd == STDOUT_FILENO)
+    {
+        fflush(stdout);
+    }
+    uint32_t index = 0;
+    uint64_t base = 0;
+    uint64_t position = offset;
+    uint64_t endOffset = offset + length;
+    while (ok && position < endOffset)
+    {
+        if (count == sliceLimit)
+        {
+            ok = writeSlices(fd, slices, count);
+            while (count > 0)
+            {
+                unpinBlock(pinned[--count]);
+            }
+        }
+        uint64_t logical = position / BLOCK_SIZE;
+        uint32_t within = position % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - within;
+        if (chunk > endOffset - position)
+        {
+            chunk = (uint32_t)(endOffset - position);
+        }
+        uint32_t block = mapFileBlock(&extents, logical, &index, &base);
+        const char *data = pinBlock(block);
+        if (data == NULL)
+        {
+            ok = false;
+            break;
+        }
+        slices[count].iov_base = (char *)data + within;
+        slices[count].iov_len = chunk;
+        pinned[count++] = block;
+        position += chunk;
+    }
+    if (ok && count > 0)
+    {
+        ok = writeSlices(fd, slices, count);
+    }
+    while (count > 0)
+    {
+        unpinBlock(pinned[--count]);
+    }
+    free(extents.extents);
+    return ok;
+}
+
+int parseCommand(char *inputBuffer, char *command, char *argument)
+{
+    int index = strcspn(inputBuffer, " ");
+    int cmdLen = (index > MAX_NAME_LEN) ? MAX_NAME_LEN : index;
+    strncpy(command, inputBuffer, cmdLen);
+    command[cmdLen] = '\0';
+
+    char *arg_ptr = inputBuffer + index;
+    while (*arg_ptr == ' ')
+    {
+        arg_ptr++;
+    }
+    strcpy(argument, arg_ptr);
+    return index;
+}
+
+int commandIs(char *command)
+{
+    if (strcmp(command, "mkdir") == 0)
+        return 1;
+    if (strcmp(command, "create") == 0)
+        return 2;
+    if (strcmp(command, "write") == 0)
+        return 3;
+    if (strcmp(command, "read") == 0)
+        return 4;
+    if (strcmp(command, "delete") == 0)
+        return 5;
+    if (strcmp(command, "rmdir") == 0)
+        return 6;
+    if (strcmp(command, "ls") == 0)
+        return 7;
+    if (strcmp(command, "cd") == 0)
+        return 8;
+    if (strcmp(command, "pwd") == 0)
+        return 9;
+    if (strcmp(command, "df") == 0)
+        return 10;
+    if (strcmp(command, "exit") == 0)
+        return 11;
+    if (strcmp(command, "sync") == 0)
+        return 12;
+    if (strcmp(command, "pread") == 0)
+        return 13;
+    if (strcmp(command, "pwrite") == 0)
+        return 14;
+    if (strcmp(command, "append") == 0)
+        return 15;
+    if (strcmp(command, "import") == 0)
+        return 16;
+    if (strcmp(command, "export") == 0)
+        return 17;
+    if (strcmp(command, "snapshot") == 0)
+        return 18;
+    if (strcmp(command, "rollback") == 0)
+        return 19;
+    return 0;
+}
+
+void buildCurrentPath(char *pathBuffer, size_t bufferSize)
+{
+    if (gCwd == gRoot)
+    {
+        snprintf(pathBuffer, bufferSize, "/");
+        return;
+    }
+    Node *path[MAX_PATH_DEPTH];
+    int depth = 0;
+    Node *current = gCwd;
+    while (current != gRoot && depth < MAX_PATH_DEPTH)
+    {
+        path[depth] = current;
+        current = nodeAt(current->parent);
+        depth++;
+    }
+    char *bufferPtr = pathBuffer;
+    char *bufferEnd = pathBuffer + bufferSize;
+    for (int i = depth - 1; i >= 0; i--)
+    {
+        int remaining = bufferEnd - bufferPtr;
+        if (remaining <= 1)
+            break; 
+        int written = snprintf(bufferPtr, remaining, "/%s", path[i]->name);
+
+        if (written < 0 || written >= remaining)
+        {
+            break;
+        }
+        bufferPtr += written;
+    }
+    if (bufferPtr == pathBuffer)
+    {
+        snprintf(pathBuffer, bufferSize, "/");
+    }
+}
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t journalChecksum(const JournalHeader *header, const char *body, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    JournalHeader unsummed = *header;
+    unsummed.checksum = 0;
+    const unsigned char *bytes = (const unsigned char *)&unsummed;
+    for (size_t i = 0; i < sizeof(unsummed); i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    bytes = (const unsigned char *)body;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t journalRecordSize(uint32_t pageCount)
+{
+    return alignUp(sizeof(JournalHeader) + (uint64_t)pageCount * sizeof(uint32_t), JOURNAL_PAGE_SIZE) +
+           (uint64_t)pageCount * JOURNAL_PAGE_SIZE;
+}
+
+static int comparePages(const void *left, const void *right)
+{
+    uint32_t a = *(const uint32_t *)left;
+    uint32_t b = *(const uint32_t *)right;
+    return (a > b) - (a < b);
+}
+
+// Fills in where each region of an image with the superblock's block and
+// inode counts lives.
+static void layoutImage(SuperBlock *super)
+{
+    super->inodeTableOffset = alignUp(sizeof(SuperBlock), 64);
+    super->bitmapOffset = alignUp(super->inodeTableOffset + (uint64_t)super->inodeCount * sizeof(Node), 64);
+    super->shareCountOffset =
+        alignUp(super->bitmapOffset + ((uint64_t)super->blockCount + 63) / 64 * sizeof(uint64_t), 64);
+    super->journalOffset = alignUp(super->shareCountOffset + super->blockCount, METADATA_ALIGN);
+    // Sized for a record carrying every metadata page, so any commit fits
+    // once the journal has been checkpointed.
+    super->journalSize =
+        alignUp(journalRecordSize((uint32_t)(super->journalOffset / JOURNAL_PAGE_SIZE)), METADATA_ALIGN);
+    super->dataOffset = super->journalOffset + super->journalSize;
+}
+
+// Whether the superblock describes an image this build can mount: its
+// regions must sit exactly where layoutImage() puts them, and the image
+// must be large enough to hold them all, so nothing mapped or indexed from
+// them can fall outside the file.
+static bool validSuperBlock(const SuperBlock *super, uint64_t imageSize)
+{
+    if (super->magic != VFS_MAGIC || super->version != VFS_VERSION || super->blockSize != BLOCK_SIZE ||
+        super->blockCount == 0 || super->inodeCount <= ROOT_INODE || super->freeInodeCount >= super->inodeCount ||
+        super->freeInodeHead >= super->inodeCount || super->freeBlockCount > super->blockCount ||
+        super->snapshotCount > MAX_SNAPSHOTS || super->snapshotReserve > super->freeInodeCount)
+        return false;
+    SuperBlock expected = *super;
+    layoutImage(&expected);
+    return super->inodeTableOffset == expected.inodeTableOffset && super->bitmapOffset == expected.bitmapOffset &&
+           super->shareCountOffset == expected.shareCountOffset && super->journalOffset == expected.journalOffset &&
+           super->journalSize == expected.journalSize && super->dataOffset == expected.dataOffset &&
+           imageSize >= super->dataOffset + (uint64_t)super->blockCount * BLOCK_SIZE;
+}
+
+static void formatImage(int fd, uint32_t blockCount, uint32_t inodeCount)
+{
+    SuperBlock super;
+    memset(&super, 0, sizeof(super));
+    super.magic = VFS_MAGIC;
+    super.version = VFS_VERSION;
+    super.blockSize = BLOCK_SIZE;
+    super.blockCount = blockCount;
+    super.inodeCount = inodeCount;
+    super.freeBlockCount = blockCount;
+    layoutImage(&super);
+    super.journalSequence = 1;
+
+    if (ftruncate(fd, 0) != 0 ||
+        ftruncate(fd, (off_t)(super.dataOffset + (uint64_t)blockCount * BLOCK_SIZE)) != 0)
+    {
+        printf("Error: Cannot size disk image: %s\n", strerror(errno));
+        exit(1);
+    }
+    char *metadata = mmap(NULL, super.journalOffset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (metadata == MAP_FAILED)
+    {
+        printf("Error: Cannot map disk image: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // The file was just truncated, so every inode and bitmap word is zero.
+    Node *inodes = (Node *)(metadata + super.inodeTableOffset);
+    Node *root = &inodes[ROOT_INODE];
+    strcpy(root->name, "/");
+    root->type = DIRECTORY;
+    root->nextSibling = ROOT_INODE;
+    root->prevSibling = ROOT_INODE;
+    for (uint32_t i = inodeCount - 1; i > ROOT_INODE; i--)
+    {
+        inodes[i].nextSibling = super.freeInodeHead;
+        super.freeInodeHead = i;
+        super.freeInodeCount++;
+    }
+    memcpy(metadata, &super, sizeof(super));
+    msync(metadata, super.journalOffset, MS_SYNC);
+    munmap(metadata, super.journalOffset);
+}
+
+// Copies every intact record of the current journal generation to its home
+// location, then starts a new generation by advancing the superblock's
+// sequence, which invalidates the records left behind. Replaying twice is
+// harmless, so a crash anywhere in here is recovered at the next mount.
+static bool replayJournal(int fd, uint64_t journalOffset, uint64_t journalSize, uint64_t *sequence,
+                          uint32_t *applied)
+{
+    uint64_t metadataPages = journalOffset / JOURNAL_PAGE_SIZE;
+    uint64_t position = 0;
+    char *record = NULL;
+    *applied = 0;
+    while (position + sizeof(JournalHeader) <= journalSize)
+    {
+        JournalHeader header;
+        if (pread(fd, &header, sizeof(header), (off_t)(journalOffset + position)) != (ssize_t)sizeof(header))
+            break;
+        if (header.magic != JOURNAL_MAGIC || header.sequence != *sequence || header.pageCount == 0 ||
+            header.pageCount > metadataPages || journalRecordSize(header.pageCount) > journalSize - position)
+            break;
+
+        uint64_t size = journalRecordSize(header.pageCount);
+        char *grown = (char *)realloc(record, size);
+        if (grown == NULL)
+        {
+            printf("Error: Malloc failed during journal replay.\n");
+            exit(1);
+        }
+        record = grown;
+        if (pread(fd, record, size, (off_t)(journalOffset + position)) != (ssize_t)size ||
+            journalChecksum(&header, record + sizeof(header), size - sizeof(header)) != header.checksum)
+            break;
+
+        const uint32_t *pages = (const uint32_t *)(record + sizeof(header));
+        const char *images = record + (size - (uint64_t)header.pageCount * JOURNAL_PAGE_SIZE);
+        // Commits log pages in ascending order, so the last one bounds them all.
+        if (pages[header.pageCount - 1] >= metadataPages)
+            break;
+        for (uint32_t i = 0; i < header.pageCount; i++)
+        {
+            if (pwrite(fd, images + (size_t)i * JOURNAL_PAGE_SIZE, JOURNAL_PAGE_SIZE,
+                       (off_t)pages[i] * JOURNAL_PAGE_SIZE) != JOURNAL_PAGE_SIZE)
+            {
+                free(record);
+                return false;
+            }
+        }
+        position += size;
+        (*sequence)++;
+        (*applied)++;
+    }
+    free(record);
+
+    if (*applied == 0)
+        return true;
+    return fdatasync(fd) == 0 &&
+           pwrite(fd, sequence, sizeof(*sequence), (off_t)offsetof(SuperBlock, journalSequence)) ==
+               (ssize_t)sizeof(*sequence) &&
+           fdatasync(fd) == 0;
+}
+
+void mountVfs(const char *imagePath, uint32_t blockCount, uint32_t inodeCount, size_t cacheBytes)
+{
+    const char *imageLabel = imagePath != NULL ? imagePath : "<scratch>";
+    if (imagePath != NULL)
+    {
+        gImageFd = open(imagePath, O_RDWR | O_CREAT, 0644);
+    }
+    else
+    {
+        // Without an image the disk is scratch space, as it always was.
+        char scratchPath[] = "/tmp/vfs-disk-XXXXXX";
+        gImageFd = mkstemp(scratchPath);
+        if (gImageFd >= 0)
+        {
+            unlink(scratchPath);
+        }
+    }
+    if (gImageFd < 0)
+    {
+        printf("Error: Cannot open disk image: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    struct stat info;
+    if (fstat(gImageFd, &info) != 0)
+    {
+        printf("Error: Cannot stat disk image: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (info.st_size == 0)
+    {
+        formatImage(gImageFd, blockCount, inodeCount);
+        if (imagePath != NULL)
+        {
+            printf("Formatted new disk image '%s' (%u blocks, %u inodes).\n", imagePath, blockCount,
+                   inodeCount);
+        }
+        if (fstat(gImageFd, &info) != 0)
+        {
+            printf("Error: Cannot stat disk image: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    // Checked before the journal is replayed, since replay writes to the
+    // metadata region the superblock describes.
+    SuperBlock super;
+    if (pread(gImageFd, &super, sizeof(super), 0) != (ssize_t)sizeof(super) ||
+        !validSuperBlock(&super, (uint64_t)info.st_size))
+    {
+        printf("Error: '%s' is not a compatible VFS image.\n", imageLabel);
+        exit(1);
+    }
+
+    uint32_t recovered = 0;
+    uint64_t sequence = super.journalSequence;
+    if (!replayJournal(gImageFd, super.journalOffset, super.journalSize, &sequence, &recovered))
+    {
+        printf("Error: Cannot replay journal: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (recovered > 0)
+    {
+        printf("Recovered %u journal records from '%s'.\n", recovered, imageLabel);
+    }
+
+    // A private mapping keeps uncommitted metadata out of the image; pages
+    // reach their home locations only by checkpointing the journal.
+    gMetadataSize = super.journalOffset;
+    gMetadata = mmap(NULL, gMetadataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, gImageFd, 0);
+    if (gMetadata == MAP_FAILED)
+    {
+        printf("Error: Cannot map disk image: %s\n", strerror(errno));
+        exit(1);
+    }
+    gSuper = (SuperBlock *)gMetadata;
+    if (gSuper->journalOffset != super.journalOffset || !validSuperBlock(gSuper, (uint64_t)info.st_size))
+    {
+        printf("Error: '%s' is not a compatible VFS image.\n", imageLabel);
+        exit(1);
+    }
+    gInodes = (Node *)(gMetadata + gSuper->inodeTableOffset);
+    gBlockBitmap = (uint64_t *)(gMetadata + gSuper->bitmapOffset);
+    gShareCounts = (uint8_t *)(gMetadata + gSuper->shareCountOffset);
+
+    gJournal.pageCount = (uint32_t)(gMetadataSize / JOURNAL_PAGE_SIZE);
+    gJournal.dirtyMap = (uint64_t *)calloc((gJournal.pageCount + 63) / 64, sizeof(uint64_t));
+    gJournal.dirtyPages = (uint32_t *)malloc(gJournal.pageCount * sizeof(uint32_t));
+    if (gJournal.dirtyMap == NULL || gJournal.dirtyPages == NULL)
+    {
+        printf("Error: Malloc failed during journal creation.\n");
+        exit(1);
+    }
+    gJournal.sequence = gSuper->journalSequence;
+
+    initBlockCache(gImageFd, gSuper->dataOffset, gSuper->blockCount, cacheBytes);
+}
+
+bool syncVfs()
+{
+    return commitJournal();
+}
+
+void unmountVfs()
+{
+    if (commitJournal())
+    {
+        checkpointJournal();
+    }
+    releaseBlockCache();
+    free(gJournal.dirtyMap);
+    free(gJournal.dirtyPages);
+    free(gJournal.pendingFrees.extents);
+    munmap(gMetadata, gMetadataSize);
+    close(gImageFd);
+}
+
+void touchMetadata(const void *address, size_t length)
+{
+    size_t offset = (size_t)((const char *)address - gMetadata);
+    uint32_t last = (uint32_t)((offset + length - 1) / JOURNAL_PAGE_SIZE);
+    for (uint32_t page = (uint32_t)(offset / JOURNAL_PAGE_SIZE); page <= last; page++)
+    {
+        uint64_t bit = 1ull << (page % 64);
+        if ((gJournal.dirtyMap[page / 64] & bit) == 0)
+        {
+            gJournal.dirtyMap[page / 64] |= bit;
+            gJournal.dirtyPages[gJournal.dirtyCount++] = page;
+        }
+    }
+}
+
+bool checkpointJournal()
+{
+    if (gJournal.tail == 0)
+        return true;
+    uint64_t sequence = gSuper->journalSequence;
+    uint32_t applied;
+    if (!replayJournal(gImageFd, gSuper->journalOffset, gSuper->journalSize, &sequence, &applied))
+    {
+        printf("Error: Journal checkpoint failed: %s\n", strerror(errno));
+        return false;
+    }
+    gSuper->journalSequence = sequence;
+    gJournal.sequence = sequence;
+    gJournal.tail = 0;
+    gJournal.checkpoints++;
+    return true;
+}
+
+// Makes everything done so far durable. Data blocks are written and synced
+// before the record that refers to them, then the touched metadata pages go
+// to the journal in one write; their home copies are only updated by a
+// later checkpoint.
+bool commitJournal()
+{
+    // Nothing is released or recorded until the data it depends on is on
+    // disk; a failed write-back leaves the frames dirty for the next try.
+    if (!flushBlockCache())
+    {
+        printf("Error: Sync failed: data blocks could not be written back.\n");
+        return false;
+    }
+    if (fdatasync(gImageFd) != 0)
+    {
+        printf("Error: Sync failed: %s\n", strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < gJournal.pendingFrees.count; i++)
+    {
+        const Extent *run = &gJournal.pendingFrees.extents[i];
+        markBlockRun(run->start, run->length, false);
+        gSuper->freeBlockCount += run->length;
+        touchMetadata(gSuper, sizeof(*gSuper));
+    }
+    gJournal.pendingFrees.count = 0;
+    gJournal.pendingFreeBlocks = 0;
+    if (gJournal.dirtyCount == 0)
+    {
+        gJournal.pendingOperations = 0;
+        return true;
+    }
+
+    uint64_t size = journalRecordSize(gJournal.dirtyCount);
+    if (gJournal.tail + size > gSuper->journalSize && !checkpointJournal())
+        return false;
+
+    char *record = (char *)calloc(1, size);
+    if (record == NULL)
+    {
+        printf("Error: Malloc failed during journal commit.\n");
+        exit(1);
+    }
+    qsort(gJournal.dirtyPages, gJournal.dirtyCount, sizeof(uint32_t), comparePages);
+    JournalHeader *header = (JournalHeader *)record;
+    header->magic = JOURNAL_MAGIC;
+    header->pageCount = gJournal.dirtyCount;
+    header->sequence = gJournal.sequence;
+    memcpy(record + sizeof(JournalHeader), gJournal.dirtyPages, gJournal.dirtyCount * sizeof(uint32_t));
+    char *images = record + (size - (uint64_t)gJournal.dirtyCount * JOURNAL_PAGE_SIZE);
+    for (uint32_t i = 0; i < gJournal.dirtyCount; i++)
+    {
+        memcpy(images + (size_t)i * JOURNAL_PAGE_SIZE, gMetadata + (size_t)gJournal.dirtyPages[i] * JOURNAL_PAGE_SIZE,
+               JOURNAL_PAGE_SIZE);
+    }
+    header->checksum = journalChecksum(header, record + sizeof(JournalHeader), size - sizeof(JournalHeader));
+
+    bool written = pwrite(gImageFd, record, size, (off_t)(gSuper->journalOffset + gJournal.tail)) == (ssize_t)size &&
+                   fdatasync(gImageFd) == 0;
+    free(record);
+    if (!written)
+    {
+        printf("Error: Journal commit failed: %s\n", strerror(errno));
+        return false;
     }
-    else
+
+    for (uint32_t i = 0; i < gJournal.dirtyCount; i++)
     {
-        newFreeNode->prevBlock = gFreeBlockTail;
-        gFreeBlockTail->nextBlock = newFreeNode;
-        gFreeBlockTail = newFreeNode;
+        gJournal.dirtyMap[gJournal.dirtyPages[i] / 64] &= ~(1ull << (gJournal.dirtyPages[i] % 64));
     }
-    gFreeBlockCount++;
+    gJournal.commits++;
+    gJournal.pagesLogged += gJournal.dirtyCount;
+    gJournal.dirtyCount = 0;
+    gJournal.pendingOperations = 0;
+    gJournal.tail += size;
+    gJournal.sequence++;
+    return true;
 }
 
-int parseCommand(char *inputBuffer, char *command, char *argument)
+// Group commit: commands only accumulate journal pages, and the group is
+// committed once enough commands, pages or time have piled up.
+void endOperation()
 {
-    int index = strcspn(inputBuffer, " ");
-    int cmdLen = (index > MAX_NAME_LEN) ? MAX_NAME_LEN : index;
-    strncpy(command, inputBuffer, cmdLen);
-    command[cmdLen] = '\0';
+    if (gJournal.dirtyCount == 0 && gJournal.pendingFreeBlocks == 0)
+        return;
+    if (gJournal.pendingOperations++ == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &gJournal.firstChange);
+    }
+    if (gJournal.pendingOperations >= GROUP_COMMIT_OPERATIONS || gJournal.dirtyCount >= GROUP_COMMIT_PAGES ||
+        elapsedSeconds(&gJournal.firstChange) * 1000 >= GROUP_COMMIT_MS)
+    {
+        commitJournal();
+    }
+}
 
-    char *arg_ptr = inputBuffer + index;
-    while (*arg_ptr == ' ')
+// The time bound above is only checked as commands end, and a session can
+// sit at the prompt for much longer. While a group is open on a terminal,
+// the wait for the next line is cut short to commit it on time. Piped input
+// is read ahead by stdio, so there the bound is per command and whatever is
+// left is committed at exit.
+void waitForInput()
+{
+    if (gJournal.pendingOperations == 0 || !isatty(STDIN_FILENO))
+        return;
+    fflush(stdout);
+    int remaining = GROUP_COMMIT_MS - (int)(elapsedSeconds(&gJournal.firstChange) * 1000);
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    if (remaining <= 0 || poll(&input, 1, remaining) == 0)
     {
-        arg_ptr++;
+        commitJournal();
     }
-    strcpy(argument, arg_ptr);
-    return index;
 }
 
-int commandIs(char *command)
+static Node *popFreeNode()
 {
-    if (strcmp(command, "mkdir") == 0)
-        return 1;
-    if (strcmp(command, "create") == 0)
-        return 2;
-    if (strcmp(command, "write") == 0)
-        return 3;
-    if (strcmp(command, "read") == 0)
-        return 4;
-    if (strcmp(command, "delete") == 0)
-        return 5;
-    if (strcmp(command, "rmdir") == 0)
-        return 6;
-    if (strcmp(command, "ls") == 0)
-        return 7;
-    if (strcmp(command, "cd") == 0)
-        return 8;
-    if (strcmp(command, "pwd") == 0)
-        return 9;
-    if (strcmp(command, "df") == 0)
-        return 10;
-    if (strcmp(command, "exit") == 0)
-        return 11;
-    return 0;
+    Node *node = nodeAt(gSuper->freeInodeHead);
+    if (node == NULL)
+        return NULL;
+    touchMetadata(gSuper, sizeof(*gSuper));
+    gSuper->freeInodeHead = node->nextSibling;
+    gSuper->freeInodeCount--;
+    return node;
 }
 
-Node *findNodeInCwd(char *name)
+// Fails rather than take an inode held back for snapshot copies.
+Node *allocNode()
 {
-    Node *headChild = gCwd->directory.child;
-    if (headChild == NULL)
-    {
+    if (gSuper->freeInodeCount <= gSuper->snapshotReserve)
         return NULL;
+    Node *node = popFreeNode();
+    if (node == NULL)
+        return NULL;
+    touchNode(node);
+    memset(node, 0, sizeof(*node));
+    node->generation = gSuper->generation;
+    return node;
+}
+
+void releaseNode(Node *node)
+{
+    if (node->type == DIRECTORY)
+    {
+        freeDirIndex(nodeId(node));
     }
-    Node *current = headChild;
-    do
+    touchNode(node);
+    touchMetadata(gSuper, sizeof(*gSuper));
+    memset(node, 0, sizeof(*node));
+    node->type = FREE_NODE;
+    node->generation = gSuper->generation;
+    node->nextSibling = gSuper->freeInodeHead;
+    gSuper->freeInodeHead = nodeId(node);
+    gSuper->freeInodeCount++;
+}
+
+static void shareNodeBlocks(const Node *node)
+{
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    for (uint32_t i = 0; i < extents.count; i++)
     {
-        if (strcmp(current->name, name) == 0)
+        shareBlockRun(extents.extents[i].start, extents.extents[i].length);
+    }
+    free(extents.extents);
+    for (uint32_t block = node->file.overflowBlock; block != NO_BLOCK;)
+    {
+        shareBlockRun(block, 1);
+        block = readExtentBlock(block)->nextBlock;
+    }
+}
+
+static void dropNodeBlocks(const Node *node)
+{
+    ExtentList extents = {NULL, 0, 0};
+    loadExtents(node, &extents);
+    releaseExtents(&extents);
+    free(extents.extents);
+    for (uint32_t block = node->file.overflowBlock; block != NO_BLOCK;)
+    {
+        uint32_t next = readExtentBlock(block)->nextBlock;
+        dropBlockRun(block, 1);
+        block = next;
+    }
+}
+
+// Every inode slot but slot 0 is free, a snapshot copy or a live node, so
+// the live ones can be counted without scanning the table.
+uint32_t countLiveNodes()
+{
+    uint32_t copies = 0;
+    for (uint32_t i = 0; i < gSuper->snapshotCount; i++)
+    {
+        copies += gSuper->snapshots[i].savedCount;
+    }
+    return gSuper->inodeCount - 1 - gSuper->freeInodeCount - copies;
+}
+
+// Copies a node the first time it changes after the latest snapshot. The
+// copy keeps its own reference to the node's blocks, so later writes have
+// to copy a shared block before changing it. Free slots are not copied:
+// rollback frees whatever was created after the snapshot. The copy comes
+// out of the inodes reserved when the snapshot was taken.
+void preserveNode(Node *node)
+{
+    if (gSuper->snapshotCount == 0 || node->generation == gSuper->generation || node->type == FREE_NODE)
+        return;
+    Node *saved = popFreeNode();
+    if (saved == NULL)
+    {
+        printf("Error: Inodes reserved for snapshot copies ran out.\n");
+        exit(1);
+    }
+    gSuper->snapshotReserve--;
+
+    Snapshot *latest = &gSuper->snapshots[gSuper->snapshotCount - 1];
+    touchMetadata(saved, sizeof(*saved));
+    memcpy(saved, node, sizeof(*saved));
+    saved->origin = nodeId(node);
+    saved->nextSaved = latest->savedHead;
+    latest->savedHead = nodeId(saved);
+    latest->savedCount++;
+    if (node->type == FILETYPE)
+    {
+        shareNodeBlocks(node);
+    }
+    touchMetadata(node, sizeof(*node));
+    node->generation = gSuper->generation;
+}
+
+// Relinks the free inode list in ascending order, skipping slots that hold
+// snapshot copies. Only links that actually change are journaled.
+static void rebuildFreeInodes()
+{
+    uint32_t head = 0;
+    uint32_t count = 0;
+    for (uint32_t id = gSuper->inodeCount - 1; id > ROOT_INODE; id--)
+    {
+        Node *node = nodeAt(id);
+        if (node->type != FREE_NODE || node->origin != 0)
+            continue;
+        if (node->nextSibling != head)
         {
-            return current;
+            touchMetadata(node, sizeof(*node));
+            node->nextSibling = head;
         }
-        current = current->nextSibling;
-    } while (current != headChild);
-    return NULL;
+        head = id;
+        count++;
+    }
+    touchMetadata(gSuper, sizeof(*gSuper));
+    gSuper->freeInodeHead = head;
+    gSuper->freeInodeCount = count;
 }
 
-void buildCurrentPath(char *pathBuffer, size_t bufferSize)
+// Restores the tree as it was when snapshot `index` was taken and drops
+// the snapshots after it. Saved copies are applied newest first, so a node
+// saved in several snapshots ends up with its oldest copy.
+void rollbackToSnapshot(uint32_t index)
 {
-    if (gCwd == gRoot)
+    // Copy the saved nodes out before restoring anything: the slot of a
+    // saved copy may itself be the home of a node being restored.
+    uint32_t savedCount = 0;
+    for (uint32_t i = index; i < gSuper->snapshotCount; i++)
     {
-        snprintf(pathBuffer, bufferSize, "/");
-        return;
+        savedCount += gSuper->snapshots[i].savedCount;
     }
-    Node *path[MAX_PATH_DEPTH];
-    int depth = 0;
-    Node *current = gCwd;
-    while (current != gRoot && depth < MAX_PATH_DEPTH)
+    Node *saved = (Node *)malloc((savedCount > 0 ? savedCount : 1) * sizeof(Node));
+    if (saved == NULL)
     {
-        path[depth] = current;
-        current = current->parent;
-        depth++;
+        printf("Error: Malloc failed during rollback.\n");
+        exit(1);
     }
-    char *bufferPtr = pathBuffer;
-    char *bufferEnd = pathBuffer + bufferSize;
-    for (int i = depth - 1; i >= 0; i--)
+    uint32_t count = 0;
+    for (uint32_t i = gSuper->snapshotCount; i-- > index;)
     {
-        int remaining = bufferEnd - bufferPtr;
-        if (remaining <= 1)
-            break; 
-        int written = snprintf(bufferPtr, remaining, "/%s", path[i]->name);
+        for (uint32_t id = gSuper->snapshots[i].savedHead; id != 0;)
+        {
+            Node *slot = nodeAt(id);
+            id = slot->nextSaved;
+            saved[count++] = *slot;
+            touchMetadata(slot, sizeof(*slot));
+            memset(slot, 0, sizeof(*slot));
+        }
+    }
 
-        if (written < 0 || written >= remaining)
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Node *node = nodeAt(saved[i].origin);
+        if (node->type == FILETYPE)
+        {
+            dropNodeBlocks(node);
+        }
+        touchMetadata(node, sizeof(*node));
+        *node = saved[i];
+        node->origin = 0;
+        node->nextSaved = 0;
+    }
+    free(saved);
+
+    // Nodes created after the snapshot have no copy to restore them from;
+    // they are the ones still newer than it.
+    for (uint32_t id = ROOT_INODE + 1; id < gSuper->inodeCount; id++)
+    {
+        Node *node = nodeAt(id);
+        if (node->type == FREE_NODE || node->origin != 0 || node->generation <= gSuper->snapshots[index].generation)
+            continue;
+        if (node->type == FILETYPE)
+        {
+            dropNodeBlocks(node);
+        }
+        touchMetadata(node, sizeof(*node));
+        memset(node, 0, sizeof(*node));
+    }
+
+    touchMetadata(gSuper, sizeof(*gSuper));
+    Snapshot *target = &gSuper->snapshots[index];
+    target->savedHead = 0;
+    target->savedCount = 0;
+    gSuper->generation = target->generation + 1;
+    memset(target + 1, 0, (gSuper->snapshotCount - index - 1) * sizeof(Snapshot));
+    gSuper->snapshotCount = index + 1;
+    rebuildFreeInodes();
+    gSuper->snapshotReserve = countLiveNodes();
+
+    // Every in-memory view of the tree may now be stale.
+    for (uint32_t i = 0; i < gSuper->inodeCount; i++)
+    {
+        freeDirIndex(i);
+    }
+    memset(gDentries, 0, sizeof(gDentries));
+    gCwd = gRoot;
+    strcpy(gCwdPath, "/");
+}
+
+void initBlockCache(int fd, uint64_t dataOffset, uint32_t blockCount, size_t cacheBytes)
+{
+    BlockCache *cache = &gBlockCache;
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = fd;
+    cache->dataOffset = dataOffset;
+    cache->blockCount = blockCount;
+
+    cache->frameCount = cacheBytes / BLOCK_SIZE;
+    if (cache->frameCount > blockCount)
+    {
+        cache->frameCount = blockCount;
+    }
+    uint32_t slotCount = 2;
+    while (slotCount < cache->frameCount * 2)
+    {
+        slotCount <<= 1;
+    }
+    cache->slotMask = slotCount - 1;
+    cache->frames = (CacheFrame *)calloc(cache->frameCount, sizeof(CacheFrame));
+    cache->frameData = (char *)malloc((size_t)cache->frameCount * BLOCK_SIZE);
+    cache->slots = (int32_t *)malloc(slotCount * sizeof(int32_t));
+    if (cache->frames == NULL || cache->frameData == NULL || cache->slots == NULL)
+    {
+        printf("Error: Malloc failed during block cache creation.\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < slotCount; i++)
+    {
+        cache->slots[i] = -1;
+    }
+}
+
+void releaseBlockCache()
+{
+    flushBlockCache();
+    free(gBlockCache.frames);
+    free(gBlockCache.frameData);
+    free(gBlockCache.slots);
+}
+
+static uint32_t blockSlot(uint32_t blockIndex)
+{
+    return (blockIndex * 2654435761u) & gBlockCache.slotMask;
+}
+
+static int32_t findCachedFrame(uint32_t blockIndex)
+{
+    BlockCache *cache = &gBlockCache;
+    for (uint32_t slot = blockSlot(blockIndex);; slot = (slot + 1) & cache->slotMask)
+    {
+        int32_t frame = cache->slots[slot];
+        if (frame < 0)
+            return -1;
+        if (cache->frames[frame].blockIndex == blockIndex)
+            return frame;
+    }
+}
+
+static void removeCachedFrame(uint32_t blockIndex)
+{
+    BlockCache *cache = &gBlockCache;
+    uint32_t slot = blockSlot(blockIndex);
+    while (cache->frames[cache->slots[slot]].blockIndex != blockIndex)
+    {
+        slot = (slot + 1) & cache->slotMask;
+    }
+    // Backward-shift the rest of the probe run so lookups never need tombstones.
+    uint32_t next = (slot + 1) & cache->slotMask;
+    while (cache->slots[next] >= 0)
+    {
+        uint32_t home = blockSlot(cache->frames[cache->slots[next]].blockIndex);
+        if (((next - home) & cache->slotMask) >= ((next - slot) & cache->slotMask))
         {
+            cache->slots[slot] = cache->slots[next];
+            slot = next;
+        }
+        next = (next + 1) & cache->slotMask;
+    }
+    cache->slots[slot] = -1;
+}
+
+// Writes the dirty run around a frame in one call. The frames stay dirty
+// if the write fails, so nothing is lost before the next attempt.
+static bool writeBackRun(int32_t frame)
+{
+    BlockCache *cache = &gBlockCache;
+    uint32_t first = cache->frames[frame].blockIndex;
+    uint32_t last = first;
+
+    while (first > 0 && last - first + 1 < MAX_WRITEBACK_RUN)
+    {
+        int32_t neighbour = findCachedFrame(first - 1);
+        if (neighbour < 0 || !cache->frames[neighbour].dirty)
+            break;
+        first--;
+    }
+    while (last + 1 < cache->blockCount && last - first + 1 < MAX_WRITEBACK_RUN)
+    {
+        int32_t neighbour = findCachedFrame(last + 1);
+        if (neighbour < 0 || !cache->frames[neighbour].dirty)
             break;
+        last++;
+    }
+
+    struct iovec vectors[MAX_WRITEBACK_RUN];
+    int count = 0;
+    for (uint32_t block = first; block <= last; block++)
+    {
+        int32_t runFrame = findCachedFrame(block);
+        vectors[count].iov_base = cache->frameData + (size_t)runFrame * BLOCK_SIZE;
+        vectors[count].iov_len = BLOCK_SIZE;
+        count++;
+    }
+    ssize_t expected = (ssize_t)count * BLOCK_SIZE;
+    cache->writeCalls++;
+    if (pwritev(cache->fd, vectors, count, (off_t)(cache->dataOffset + (uint64_t)first * BLOCK_SIZE)) !=
+        expected)
+    {
+        printf("Error: Write-back of blocks %u-%u failed: %s\n", first, last, strerror(errno));
+        return false;
+    }
+    for (uint32_t block = first; block <= last; block++)
+    {
+        cache->frames[findCachedFrame(block)].dirty = false;
+    }
+    cache->writeBacks += count;
+    return true;
+}
+
+static int32_t evictFrame()
+{
+    BlockCache *cache = &gBlockCache;
+    uint32_t failedWrites = 0;
+    uint32_t pinnedRun = 0;
+    for (;;)
+    {
+        int32_t frame = (int32_t)cache->clockHand;
+        CacheFrame *candidate = &cache->frames[frame];
+        cache->clockHand = (cache->clockHand + 1) % cache->frameCount;
+        if (!candidate->valid)
+            return frame;
+        if (candidate->pinCount > 0)
+        {
+            // Pins are released before the next command, so a full sweep of
+            // pinned frames is a bug, not something to wait out.
+            if (++pinnedRun >= cache->frameCount)
+            {
+                printf("Error: Every block cache frame is pinned.\n");
+                exit(1);
+            }
+            continue;
         }
-        bufferPtr += written;
+        pinnedRun = 0;
+        if (candidate->referenced)
+        {
+            candidate->referenced = false;
+            continue;
+        }
+        // A frame that cannot be written back keeps its data; try the next
+        // one, and give up only once a whole sweep has failed.
+        if (candidate->dirty && !writeBackRun(frame))
+        {
+            if (++failedWrites >= cache->frameCount)
+            {
+                printf("Error: No block cache frame can be written back.\n");
+                exit(1);
+            }
+            continue;
+        }
+        removeCachedFrame(candidate->blockIndex);
+        candidate->valid = false;
+        return frame;
     }
-    if (bufferPtr == pathBuffer)
+}
+
+// Returns the cached contents of a block. The pointer stays valid until the
+// next cacheBlock() call, which may evict the frame. Returns NULL, leaving
+// the frame unused, if the block cannot be read from the image.
+char *cacheBlock(uint32_t blockIndex, BlockAccess access)
+{
+    BlockCache *cache = &gBlockCache;
+    int32_t frame = findCachedFrame(blockIndex);
+    if (frame >= 0)
     {
-        snprintf(pathBuffer, bufferSize, "/");
+        cache->hits++;
     }
-}
\ No newline at end of file
+    else
+    {
+        cache->misses++;
+        frame = evictFrame();
+        char *data = cache->frameData + (size_t)frame * BLOCK_SIZE;
+        if (access != BLOCK_OVERWRITE &&
+            pread(cache->fd, data, BLOCK_SIZE, (off_t)(cache->dataOffset + (uint64_t)blockIndex * BLOCK_SIZE)) !=
+                BLOCK_SIZE)
+        {
+            printf("Error: Read of block %u failed.\n", blockIndex);
+            return NULL;
+        }
+        CacheFrame *entry = &cache->frames[frame];
+        entry->blockIndex = blockIndex;
+        entry->valid = true;
+        entry->dirty = false;
+
+        uint32_t slot = blockSlot(blockIndex);
+        while (cache->slots[slot] >= 0)
+        {
+            slot = (slot + 1) & cache->slotMask;
+        }
+        cache->slots[slot] = frame;
+    }
+
+    CacheFrame *entry = &cache->frames[frame];
+    entry->referenced = true;
+    if (access != BLOCK_READ)
+    {
+        entry->dirty = true;
+    }
+    return cache->frameData + (size_t)frame * BLOCK_SIZE;
+}
+
+// Like cacheBlock(), but the frame cannot be evicted until unpinBlock(),
+// so several blocks can be handed to one writev.
+const char *pinBlock(uint32_t blockIndex)
+{
+    const char *data = cacheBlock(blockIndex, BLOCK_READ);
+    if (data == NULL)
+        return NULL;
+    gBlockCache.frames[findCachedFrame(blockIndex)].pinCount++;
+    return data;
+}
+
+void unpinBlock(uint32_t blockIndex)
+{
+    gBlockCache.frames[findCachedFrame(blockIndex)].pinCount--;
+}
+
+// Extent blocks describe where a file lives; going on without one would
+// lose track of its blocks, so a failed read ends the program before the
+// journal commits anything built on it.
+const ExtentBlock *readExtentBlock(uint32_t blockIndex)
+{
+    const ExtentBlock *overflow = (const ExtentBlock *)cacheBlock(blockIndex, BLOCK_READ);
+    if (overflow == NULL)
+    {
+        printf("Error: Extent block %u cannot be read.\n", blockIndex);
+        exit(1);
+    }
+    return overflow;
+}
+
+// Direct transfers must not race cached copies of the same blocks: before
+// a device read, dirty copies are written back; before a device write, any
+// copy is dropped so a later write-back cannot overwrite the new data.
+static bool syncCachedRun(uint32_t runStart, uint32_t runLength, bool discard)
+{
+    BlockCache *cache = &gBlockCache;
+    if (runLength <= cache->frameCount)
+    {
+        for (uint32_t block = runStart; block < runStart + runLength; block++)
+        {
+            int32_t frame = findCachedFrame(block);
+            if (frame < 0)
+                continue;
+            if (discard)
+            {
+                removeCachedFrame(block);
+                cache->frames[frame].valid = false;
+                cache->frames[frame].dirty = false;
+            }
+            else if (cache->frames[frame].dirty && !writeBackRun(frame))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (uint32_t frame = 0; frame < cache->frameCount; frame++)
+    {
+        CacheFrame *entry = &cache->frames[frame];
+        if (!entry->valid || entry->blockIndex < runStart || entry->blockIndex >= runStart + runLength)
+            continue;
+        if (discard)
+        {
+            removeCachedFrame(entry->blockIndex);
+            entry->valid = false;
+            entry->dirty = false;
+        }
+        else if (entry->dirty && !writeBackRun((int32_t)frame))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool readDeviceRun(uint32_t runStart, uint32_t runLength, char *buffer)
+{
+    BlockCache *cache = &gBlockCache;
+    if (!syncCachedRun(runStart, runLength, false))
+        return false;
+    size_t total = (size_t)runLength * BLOCK_SIZE;
+    off_t offset = (off_t)(cache->dataOffset + (uint64_t)runStart * BLOCK_SIZE);
+    for (size_t done = 0; done < total;)
+    {
+        ssize_t count = pread(cache->fd, buffer + done, total - done, offset + done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            printf("Error: Read of blocks %u-%u failed.\n", runStart, runStart + runLength - 1);
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+bool writeDeviceRun(uint32_t runStart, uint32_t runLength, const char *buffer)
+{
+    BlockCache *cache = &gBlockCache;
+    syncCachedRun(runStart, runLength, true);
+    size_t total = (size_t)runLength * BLOCK_SIZE;
+    off_t offset = (off_t)(cache->dataOffset + (uint64_t)runStart * BLOCK_SIZE);
+    for (size_t done = 0; done < total;)
+    {
+        ssize_t count = pwrite(cache->fd, buffer + done, total - done, offset + done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            printf("Error: Write of blocks %u-%u failed: %s\n", runStart, runStart + runLength - 1,
+                   strerror(errno));
+            return false;
+        }
+        done += count;
+    }
+    cache->writeBacks += runLength;
+    cache->writeCalls++;
+    return true;
+}
+
+bool flushBlockCache()
+{
+    BlockCache *cache = &gBlockCache;
+    for (uint32_t i = 0; i < cache->frameCount; i++)
+    {
+        if (cache->frames[i].valid && cache->frames[i].dirty && !writeBackRun((int32_t)i))
+            return false;
+    }
+    return true;
+}